@@ -0,0 +1,89 @@
+# Copyright (C) 2026 VIB/BEG/UGent - Tim Diels <tim@diels.me>
+#
+# This file is part of varbio.
+#
+# varbio is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# varbio is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with varbio.  If not, see <http://www.gnu.org/licenses/>.
+
+from itertools import product
+import signal
+
+import numpy as np
+import pytest
+
+
+# http://stackoverflow.com/a/30091579/1031434
+signal.signal(signal.SIGPIPE, signal.SIG_IGN)  # Ignore SIGPIPE
+
+# (genes, samples) of the synthetic matrices, the first is the default
+_SHAPES = list(product((1000, 10000, 30000), (100, 1000)))
+
+def pytest_addoption(parser):
+    parser.addoption(
+        '--all-shapes', action='store_true',
+        help=(
+            'Benchmark all matrix shapes, up to 30k genes x 1k samples, '
+            'instead of only 1k x 100'
+        )
+    )
+
+def pytest_generate_tests(metafunc):
+    if 'shape' in metafunc.fixturenames:
+        shapes = _SHAPES if metafunc.config.getoption('all_shapes') else _SHAPES[:1]
+        metafunc.parametrize(
+            'shape', shapes, ids=[f'{genes}x{samples}' for genes, samples in shapes],
+            scope='session'
+        )
+
+@pytest.fixture(scope='session')
+def values(shape):
+    return np.random.default_rng(0).normal(size=shape)
+
+@pytest.fixture(scope='session')
+def genes(values):
+    return [f'gene{i}' for i in range(len(values))]
+
+@pytest.fixture(scope='session')
+def header(values):
+    return ['gene'] + [f'sample{i}' for i in range(values.shape[1])]
+
+@pytest.fixture(scope='session', params=('utf-8', 'utf-8-sig', 'utf-16'))
+def csv_file(request, tmp_path_factory, values, genes, header):
+    'CSV file, as UTF-8, UTF-8 with BOM or UTF-16 (which has a BOM)'
+    path = tmp_path_factory.mktemp('csv') / 'matrix.csv'
+    with path.open('w', encoding=request.param) as f:
+        f.write(','.join(header) + '\n')
+        for gene, row in zip(genes, values):
+            f.write(gene + ',' + ','.join(map(repr, row.tolist())) + '\n')
+    return path
+
+@pytest.fixture(scope='session')
+def matrix_dict(values, genes, header):
+    'Matrix as parse_yaml returns it'
+    return {
+        'name': 'matrix',
+        'data': [header] + [
+            [gene] + row for gene, row in zip(genes, values.tolist())
+        ],
+    }
+
+@pytest.fixture(scope='session')
+def yaml_file(tmp_path_factory, matrix_dict):
+    'YAML file of a matrix, a flow sequence per row like users tend to write'
+    path = tmp_path_factory.mktemp('yaml') / 'matrix.yaml'
+    with path.open('w') as f:
+        f.write('name: matrix\ndata: [\n')
+        for row in matrix_dict['data']:
+            f.write('  [' + ', '.join(map(str, row)) + '],\n')
+        f.write(']\n')
+    return path
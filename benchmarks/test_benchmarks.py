@@ -0,0 +1,115 @@
+# Copyright (C) 2026 VIB/BEG/UGent - Tim Diels <tim@diels.me>
+#
+# This file is part of varbio.
+#
+# varbio is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# varbio is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with varbio.  If not, see <http://www.gnu.org/licenses/>.
+
+'''
+Benchmarks of the parsing and correlation hot paths
+
+Run with ``pytest benchmarks``, add ``--all-shapes`` for realistic sizes.
+Requires pytest-benchmark. Besides timings, how much a single run raised the
+peak resident set size is recorded as ``peak_memory`` in the extra info of each
+benchmark, see ``--benchmark-json``. Unlike tracemalloc, this includes the
+buffers of numpy, pandas and BLAS. The run is forked off so that the peak of
+previous benchmarks does not hide it, so this requires a platform with fork.
+'''
+
+import multiprocessing
+import resource
+import sys
+
+import numpy as np
+import pandas as pd
+import pytest
+
+from varbio import (
+    open_text, parse_csv, parse_yaml, ExpressionMatrix, pearson, pearson_df
+)
+
+
+def run(benchmark, function, *args, **kwargs):
+    'Benchmark function, recording the peak memory of a first run'
+    benchmark.extra_info['peak_memory'] = peak_memory(function, *args, **kwargs)
+    return benchmark(function, *args, **kwargs)
+
+def peak_memory(function, *args, **kwargs):
+    'Get by how many bytes calling function raises the peak RSS of a fork'
+    context = multiprocessing.get_context('fork')
+    receiver, sender = context.Pipe(duplex=False)
+    process = context.Process(
+        target=_send_peak_memory, args=(sender, function, args, kwargs)
+    )
+    process.start()
+    sender.close()  # so recv gets EOF rather than hangs if the fork fails
+    try:
+        peak = receiver.recv()
+    except EOFError:
+        peak = None
+    process.join()
+    if peak is None:
+        pytest.fail(
+            f'{function} failed in the fork measuring its memory, exit code '
+            f'{process.exitcode}, see its traceback above'
+        )
+    return peak
+
+def _send_peak_memory(connection, function, args, kwargs):
+    # The fork starts with a peak of the RSS it inherited
+    before = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    function(*args, **kwargs)
+    after = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    unit = 1 if sys.platform == 'darwin' else 1024  # bytes on macOS, else KiB
+    connection.send((after - before) * unit)
+
+def read_text(path):
+    with open_text(path) as f:
+        for _ in f:
+            pass
+
+def test_open_text(benchmark, csv_file):
+    run(benchmark, read_text, csv_file)
+
+@pytest.mark.parametrize('engine', ('python', 'pandas'))
+def test_parse_csv(benchmark, csv_file, engine):
+    run(benchmark, lambda: list(parse_csv(csv_file, engine=engine)))
+
+@pytest.fixture(scope='session')
+def csv_rows(values, genes, header):
+    return [header] + [
+        [gene] + list(map(repr, row)) for gene, row in zip(genes, values.tolist())
+    ]
+
+def test_from_csv(benchmark, csv_rows):
+    run(benchmark, ExpressionMatrix.from_csv, 'matrix', csv_rows)
+
+def test_from_dict(benchmark, matrix_dict):
+    run(benchmark, ExpressionMatrix.from_dict, matrix_dict)
+
+@pytest.mark.parametrize('fast', (False, True))
+def test_parse_yaml(benchmark, yaml_file, fast):
+    run(benchmark, parse_yaml, yaml_file, fast=fast)
+
+# Typical bait counts of CoExpNetViz and MORPH
+@pytest.fixture(params=(10, 1000))
+def indices(request, values):
+    return np.random.default_rng(1).choice(len(values), request.param, replace=False)
+
+@pytest.mark.parametrize('dtype', (np.float64, np.float32))
+def test_pearson(benchmark, values, indices, dtype):
+    run(benchmark, pearson, values, indices, dtype=dtype)
+
+def test_pearson_df(benchmark, values, genes, indices):
+    data = pd.DataFrame(values, index=genes)
+    run(benchmark, pearson_df, data, data.iloc[indices])
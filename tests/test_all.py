@@ -18,6 +18,12 @@
 
 from copy import copy
 from importlib import resources
+import bz2
+import gzip
+import json
+import logging
+import lzma
+import time
 import warnings
 
 from pytil.data_frame import assert_df_equals
@@ -26,9 +32,13 @@ import pandas as pd
 import pytest
 import scipy.stats
 
+import varbio._csv
 from varbio import (
-    pearson, pearson_df, parse_yaml, ExpressionMatrix, UserError, parse_csv,
-    parse_baits
+    pearson, pearson_blocks, pearson_edges, pearson_batch,
+    pearson_permutation_test, pearson_all, pearson_all_edges, pearson_df,
+    pearson_df_edges, pearson_df_batch, pearson_df_permutation_test, spearman,
+    spearman_df, meta_pearson, parse_yaml, ExpressionMatrix, UserError,
+    parse_csv, parse_baits, open_text, ParseCache, PearsonAccumulator, span
 )
 
 
@@ -36,12 +46,95 @@ pearsonr = lambda x, y: scipy.stats.pearsonr(x, y)[0]
 np.random.seed(0)
 
 
+class TestOpenText:
+
+    'Most encodings are covered by parse_csv/yaml tests, which use open_text'
+
+    def test_sample_ascii(self, tmp_path):
+        'When the sample is ASCII, assume UTF-8 for the rest'
+        path = tmp_path / 'file'
+        text = 'a' * 100 + 'é'
+        path.write_bytes(text.encode('utf-8'))
+        with open_text(path, sample_size=10) as f:
+            assert f.read() == text
+
+    def test_whole_file(self, tmp_path):
+        path = tmp_path / 'file'
+        text = 'a' * 100 + 'é'
+        path.write_bytes(text.encode('utf-8'))
+        with open_text(path, sample_size=None) as f:
+            assert f.read() == text
+
+    def test_sample_misleading(self, tmp_path):
+        'Non-UTF-8 after an ASCII sample is a user error suggesting the fix'
+        path = tmp_path / 'file.csv'
+        path.write_bytes(('gene,col1\n' + 'x,1\n' * 30 + 'café,2\n').encode('latin-1'))
+        with pytest.raises(UserError) as ex:
+            list(parse_csv(path, engine='python', sample_size=10))
+        assert 'sample_size=None' in str(ex.value)
+        rows = list(parse_csv(path, engine='python', sample_size=None))
+        assert len(rows) == 32
+
+    @pytest.mark.parametrize('encoding', ('utf-8-sig', 'utf-16', 'utf-32'))
+    def test_bom(self, tmp_path, encoding):
+        'Always decode by BOM, even if the sample is tiny'
+        path = tmp_path / 'file'
+        path.write_bytes('gene,col1\n'.encode(encoding))
+        with open_text(path, sample_size=4) as f:
+            assert f.read() == 'gene,col1\n'
+
+def _compressor(name):
+    if name == 'zstd':
+        zstandard = pytest.importorskip('zstandard')
+        return zstandard.ZstdCompressor().compress
+    return {'gzip': gzip.compress, 'bz2': bz2.compress, 'xz': lzma.compress}[name]
+
+class TestCompressed:
+
+    'open_text decompresses, so all parse functions can read compressed files'
+
+    @pytest.fixture(params=('gzip', 'bz2', 'xz', 'zstd'))
+    def write(self, request, tmp_path):
+        compress = _compressor(request.param)
+        def write(data):
+            path = tmp_path / 'file'
+            path.write_bytes(compress(data))
+            return path
+        return write
+
+    def test_open_text(self, write):
+        'Encoding is detected from the decompressed data'
+        text = 'gene,col1\né,1\n'
+        with open_text(write(text.encode('utf-16'))) as f:
+            assert f.read() == text
+
+    def test_empty(self, write):
+        with open_text(write(b'')) as f:
+            assert f.read() == ''
+
+    @pytest.mark.parametrize('engine', ('python', 'pandas'))
+    def test_parse_csv(self, write, engine):
+        path = write(b'gene,col1\ngene1,1\ngene2,2\n')
+        assert list(parse_csv(path, engine=engine)) == [
+            ['gene', 'col1'], ['gene1', '1'], ['gene2', '2']
+        ]
+
+    def test_parse_yaml(self, write):
+        assert parse_yaml(write(b'key: [1, 2]')) == {'key': [1, 2]}
+
+    def test_parse_baits(self, write):
+        assert parse_baits(write(b'a b\nc'), min_baits=3) == ['a', 'b', 'c']
+
 class TestParseCSV:
 
-    def _parse(self, name):
+    @pytest.fixture(autouse=True, params=('python', 'pandas'))
+    def engine(self, request):
+        self._engine = request.param
+
+    def _parse(self, name, **kwargs):
         ctx = resources.path('tests.data.parse_csv_is_robust', name)
         with ctx as path:
-            return list(parse_csv(path))
+            return list(parse_csv(path, engine=self._engine, **kwargs))
 
     @pytest.mark.parametrize('name', (
         # Autodetect encoding
@@ -72,9 +165,12 @@ class TestParseCSV:
         # Ignore empty lines
         'empty_lines.csv',
     ))
-    def test_is_robust(self, name):
+    @pytest.mark.parametrize('sniff', (
+        {}, {'sniff_lines': 2}, {'sniff_lines': None, 'sniff_chars': None},
+    ))
+    def test_is_robust(self, name, sniff):
         'See #3'
-        assert self._parse(name) == [
+        assert self._parse(name, **sniff) == [
             ['gene', 'col1', 'col2'],
             ['gene1', '12.2', '34.5'],
         ]
@@ -115,12 +211,54 @@ class TestParseCSV:
         assert 'line 4 (1-based)' in msg
         assert 'gene3,5.6' in msg
 
+    def test_streaming_line_number(self, tmp_path):
+        'When streaming, errors still report the original line number'
+        path = tmp_path / 'file.csv'
+        lines = ['gene,col1,col2'] + [f'gene{i},1,2\n' for i in range(1000)]
+        lines[800] = 'gene800,1\n'
+        path.write_text('\n'.join(lines))
+        with pytest.raises(UserError) as ex:
+            list(parse_csv(
+                path, sniff_lines=10, sniff_chars=None, engine=self._engine
+            ))
+        msg = str(ex.value).lower()
+        assert 'has 2 columns' in msg
+        assert 'line 1600 (1-based)' in msg
+        assert 'gene800,1' in msg
+
+    @pytest.mark.parametrize('max_lines,max_chars,expected', (
+        (None, None, 5),
+        (3, None, 3),
+        (None, 7, 3),  # stop once the sample has 7 chars
+        (1, 1, 2),  # but sample at least 2 lines
+    ))
+    def test_read_sample(self, max_lines, max_chars, expected):
+        lines = iter([(i, 'abc') for i in range(5)])
+        sample = varbio._csv._read_sample(lines, max_lines, max_chars)
+        assert sample == [(i, 'abc') for i in range(expected)]
+        # The rest is left to be parsed
+        assert len(list(lines)) == 5 - expected
+
     def test_raise_if_empty_file(self):
         with pytest.raises(UserError) as ex:
             self._parse('empty_file.csv')
         msg = str(ex.value).lower()
         assert 'must contain at least a header' in msg
 
+    def test_many_rows(self, tmp_path):
+        'When parsing multiple chunks'
+        path = tmp_path / 'file.csv'
+        rows = [['gene', 'col1', 'col2']] + [
+            [f'gene{i}', str(i), '2'] for i in range(100000)
+        ]
+        path.write_text('\n'.join(map(','.join, rows)))
+        assert list(parse_csv(path, engine=self._engine)) == rows
+
+    def test_unknown_engine(self):
+        with pytest.raises(ValueError) as ex:
+            list(parse_csv(None, engine='magic'))
+        assert 'magic' in str(ex.value)
+
 @pytest.mark.parametrize('name', (
     # Handle inconsistent line endings
     'dos.yaml', 'incorrect_line_endings.yaml',
@@ -132,10 +270,11 @@ class TestParseCSV:
     # Ignore valid whitespace
     'valid_whitespace.yaml',
 ))
-def test_parse_yaml_is_robust(name):
+@pytest.mark.parametrize('fast', (False, True))
+def test_parse_yaml_is_robust(name, fast):
     'See #3'
     with resources.path('tests.data.parse_yaml_is_robust', name) as path:
-        assert parse_yaml(path) == [
+        assert parse_yaml(path, fast=fast) == [
             ['gene', 'col1', 'col2'],
             ['gene1', 12.2, 34.5],
         ]
@@ -171,6 +310,141 @@ class TestParseBaits:
                 parse_baits(path, min_baits=9)
         assert 'at least 9' in str(ex.value)
 
+    def test_duplicates(self, tmp_path):
+        'Dropped, keeping the order of first occurrence'
+        path = tmp_path / 'baits'
+        path.write_text('b a b\nc a')
+        assert parse_baits(path, min_baits=3) == ['b', 'a', 'c']
+        with pytest.raises(UserError) as ex:
+            parse_baits(path, min_baits=4)
+        assert 'contains only 3' in str(ex.value)
+
+    @pytest.mark.parametrize('chunk_size', (1, 2, 3, 5))
+    def test_chunks(self, tmp_path, chunk_size):
+        'Baits spanning chunks are read whole'
+        path = tmp_path / 'baits'
+        path.write_text('bait1, bait22;\n bait333 b4')
+        actual = varbio._various._read_baits(path, 2**20, chunk_size=chunk_size)
+        assert actual == ['bait1', 'bait22', 'bait333', 'b4']
+
+class TestParseCache:
+
+    @pytest.fixture
+    def cache(self, tmp_path):
+        return ParseCache(tmp_path / 'cache')
+
+    @pytest.fixture
+    def no_parse(self, monkeypatch):
+        'Make parsing fail, so only cache hits succeed'
+        def fail(path, *args, **kwargs):
+            raise AssertionError(f'Parsed {path}')
+        def _no_parse():
+            monkeypatch.setattr('varbio._csv.open_text', fail)
+            monkeypatch.setattr('varbio._various.open_text', fail)
+        return _no_parse
+
+    def test_parse_csv(self, cache, no_parse, tmp_path):
+        path = tmp_path / 'file.csv'
+        path.write_text('gene,col1\ngene1,1\n')
+        expected = [['gene', 'col1'], ['gene1', '1']]
+        assert list(parse_csv(path, cache=cache)) == expected
+        no_parse()
+        assert list(parse_csv(path, cache=cache)) == expected
+
+        # Other content or options miss
+        with pytest.raises(AssertionError):
+            list(parse_csv(path, sniff_lines=3, cache=cache))
+        path.write_text('gene,col1\ngene1,2\n')
+        with pytest.raises(AssertionError):
+            list(parse_csv(path, cache=cache))
+
+    def test_parse_yaml(self, cache, no_parse, tmp_path):
+        path = tmp_path / 'file.yaml'
+        path.write_text('[1, a]')
+        assert parse_yaml(path, cache=cache) == [1, 'a']
+        no_parse()
+        assert parse_yaml(path, cache=cache) == [1, 'a']
+
+    def test_parse_baits(self, cache, no_parse, tmp_path):
+        path = tmp_path / 'baits'
+        path.write_text('a b c')
+        assert parse_baits(path, min_baits=1, cache=cache) == ['a', 'b', 'c']
+        no_parse()
+        assert parse_baits(path, min_baits=1, cache=cache) == ['a', 'b', 'c']
+        with pytest.raises(UserError) as ex:
+            parse_baits(path, min_baits=4, cache=cache)
+        assert 'at least 4' in str(ex.value)
+
+    def test_read_csv(self, cache, no_parse, tmp_path):
+        path = tmp_path / 'file.csv'
+        path.write_text('gene,col1\ngene1,1\n')
+        expected = ExpressionMatrix.read_csv('myname', path)
+        assert_df_equals(
+            ExpressionMatrix.read_csv('myname', path, cache=cache).data,
+            expected.data
+        )
+        no_parse()
+        actual = ExpressionMatrix.read_csv('myname', path, cache=cache)
+        assert actual.name == 'myname'
+        assert_df_equals(actual.data, expected.data)
+
+class TestSpans:
+
+    @pytest.fixture
+    def records(self, caplog):
+        caplog.set_level(logging.DEBUG, logger='varbio.spans')
+        def records():
+            return {
+                record.span['span']: record.span
+                for record in caplog.records
+                if hasattr(record, 'span')
+            }
+        return records
+
+    def test_disabled(self, caplog):
+        caplog.set_level(logging.INFO, logger='varbio.spans')
+        with span('nothing', count=1) as fields:
+            fields['more'] = 2
+        assert not caplog.records
+
+    def test_span(self, records):
+        with span('myspan', count=1) as fields:
+            fields['more'] = 2
+        record = records()['myspan']
+        assert record['count'] == 1
+        assert record['more'] == 2
+        assert record['seconds'] >= 0
+        if record['max_rss_start'] is not None:
+            assert 0 < record['max_rss_start'] <= record['max_rss_end']
+
+    def test_read_csv(self, records, tmp_path):
+        path = tmp_path / 'file.csv'
+        path.write_text('gene,col1\ngene1,1\ngene2,2\n')
+        ExpressionMatrix.read_csv('myname', path)
+        records = records()
+        assert records['open_text']['encoding'] == 'ascii'
+        assert records['parse_csv']['rows'] == 3
+        assert records['ExpressionMatrix.from_csv']['shape'] == (2, 1)
+
+    def test_parse_csv_seconds(self, records, tmp_path):
+        'Only the parsing counts, not what the consumer does between rows'
+        path = tmp_path / 'file.csv'
+        path.write_text('gene,col1\ngene1,1\ngene2,2\n')
+        for _ in parse_csv(path):
+            time.sleep(0.1)
+        assert records()['parse_csv']['seconds'] < 0.3
+
+    def test_pearson(self, records):
+        pearson(np.random.rand(5, 3), [0, 1])
+        assert records()['pearson']['shape'] == (5, 3)
+
+    def test_json_lines(self):
+        record = logging.makeLogRecord({'span': {'span': 'myspan', 'shape': (1, 2)}})
+        line = varbio._various._JsonLinesFormatter().format(record)
+        assert json.loads(line) == {
+            'span': 'myspan', 'shape': [1, 2], 'time': record.created
+        }
+
 class TestExpressionMatrixHappyDays:
 
     @staticmethod
@@ -208,7 +482,7 @@ class TestExpressionMatrixHappyDays:
 
     def test_from_csv(self):
         '''
-        relies on _from_array and already got validated a lot by parse_csv so
+        relies on _from_values and already got validated a lot by parse_csv so
         we only need test its happy days case
         '''
         matrix = ExpressionMatrix.from_csv(
@@ -250,6 +524,46 @@ class TestExpressionMatrixFromDict:
         assert '1 values are not of a number type' in caplog.text
         assert "'1.3'" in caplog.text
 
+    def test_warn_first_10_odd_values(self, caplog):
+        ExpressionMatrix.from_dict({
+            'name': 'myname',
+            'data': [['gene', 'col1']] + [[f'row{i}', str(i)] for i in range(12)],
+        })
+        assert '12 values are not of a number type' in caplog.text
+        assert "'9', ..." in caplog.text
+        assert "'10'" not in caplog.text
+
+    def test_type_check_limit(self, caplog):
+        'Only check the first values'
+        data = [['gene', 'col1', 'col2'], ['row1', 1, '2'], ['row2', '3', 4]]
+        ExpressionMatrix.from_dict(
+            {'name': 'myname', 'data': data}, type_check_limit=2
+        )
+        assert '1 of the first 2 values are not of a number type' in caplog.text
+        assert "'2'" in caplog.text
+        assert "'3'" not in caplog.text
+
+    def test_raise_if_invalid_float(self):
+        with pytest.raises(UserError) as ex:
+            ExpressionMatrix.from_dict({
+                'name': 'myname',
+                'data': [
+                    ['gene', 'col1', 'col2'],
+                    ['row1', 1.2, 'abc'],
+                ]
+            })
+        msg = str(ex.value)
+        assert 'Invalid float value: could not convert string to float' in msg
+        assert "'abc'" in msg
+
+    def test_header_only(self):
+        matrix = ExpressionMatrix.from_dict({
+            'name': 'myname',
+            'data': [['gene', 'col1', 'col2']],
+        })
+        assert matrix.data.shape == (0, 2)
+        assert matrix.data.columns.tolist() == ['col1', 'col2']
+
     def test_raise_on_single_row(self):
         'Raise user friendly error when only a single row'
         with pytest.raises(UserError) as ex:
@@ -279,15 +593,221 @@ class TestExpressionMatrixFromDict:
         assert '2nd' in msg
         assert 'less columns' in msg
 
-class TestExpressionMatrixFromArray:
+class TestExpressionMatrixFromCsv:
+
+    def test_many_rows(self):
+        'Rows are streamed into a buffer which grows as needed'
+        def data():
+            yield ['gene', 'col1', 'col2']
+            for i in range(3000):
+                yield [f'row{i}', str(i), '1e-3']
+        matrix = ExpressionMatrix.from_csv(name='myname', data=data())
+        assert matrix.data.shape == (3000, 2)
+        assert matrix.data.index[-1] == 'row2999'
+        np.testing.assert_array_equal(matrix.data['col1'], np.arange(3000))
+        assert (matrix.data['col2'] == 1e-3).all()
+
+    def test_float32(self):
+        data = [['gene', 'col1'], ['row1', '1.5'], ['row2', '2']]
+        matrix = ExpressionMatrix.from_csv(name='myname', data=data, dtype=np.float32)
+        assert (matrix.data.dtypes == np.float32).all()
+        np.testing.assert_array_equal(matrix.data['col1'], [1.5, 2])
 
-    def test_keep_index_and_cols_as_str(self):
-        matrix = ExpressionMatrix._from_array(
-            name='myname',
-            data=np.array([
-                ['1', '2'],
-                ['3', 1.2],
+    def test_raise_if_duplicate_index(self):
+        with pytest.raises(UserError) as ex:
+            ExpressionMatrix.from_csv(name='myname', data=[
+                ['gene', 'col1'],
+                ['row1', '1.2'],
+                ['row1', '1.3'],
+            ])
+        msg = str(ex.value)
+        assert 'duplicate row names' in msg
+        assert 'row1' in msg
+
+    @pytest.mark.parametrize('value', ['1.000,2', '1,2'])
+    def test_raise_if_invalid_float(self, value):
+        with pytest.raises(UserError) as ex:
+            ExpressionMatrix.from_csv(name='myname', data=[
+                ['gene', 'col1'],
+                ['row1', value],
             ])
+        msg = str(ex.value)
+        assert 'Invalid float value: could not convert string to float' in msg
+        assert value in msg
+
+class TestExpressionMatrixSaveLoad:
+
+    @pytest.fixture
+    def matrix(self):
+        return ExpressionMatrix.from_csv(name='myname', data=[
+            ['mygene', 'col1', 'col2'],
+            ['row1', '1.2', '3.4'],
+            ['row2', '5.6', '7.8'],
+        ])
+
+    @pytest.mark.parametrize('mmap', (True, False))
+    def test_round_trip(self, matrix, tmp_path, mmap):
+        matrix.save(tmp_path / 'matrix')
+        loaded = ExpressionMatrix.load(tmp_path / 'matrix', mmap=mmap)
+        assert loaded.name == 'myname'
+        assert_df_equals(loaded.data, matrix.data)
+        assert loaded.data.index.name == 'mygene'
+
+    def test_overwrite(self, matrix, tmp_path):
+        'Matrices memory mapped from the old save stay intact'
+        path = tmp_path / 'matrix'
+        matrix.save(path)
+        old = ExpressionMatrix.load(path)
+        other = matrix.astype(np.float32)
+        other.data.iloc[0, 0] = 9
+        other.save(path)
+        assert_df_equals(old.data, matrix.data)
+        assert_df_equals(ExpressionMatrix.load(path).data, other.data)
+        assert [item.name for item in tmp_path.iterdir()] == ['matrix']
+
+    def test_interrupted(self, matrix, tmp_path, monkeypatch):
+        'Leave the old save as it was'
+        path = tmp_path / 'matrix'
+        matrix.save(path)
+        def fail(*_):
+            raise KeyboardInterrupt()
+        monkeypatch.setattr(np, 'save', fail)
+        with pytest.raises(KeyboardInterrupt):
+            matrix.save(path)
+        assert_df_equals(ExpressionMatrix.load(path).data, matrix.data)
+        assert [item.name for item in tmp_path.iterdir()] == ['matrix']
+
+    def test_raise_if_other_format_version(self, matrix, tmp_path):
+        path = tmp_path / 'matrix'
+        matrix.save(path)
+        meta = (path / 'meta.json').read_text()
+        (path / 'meta.json').write_text(
+            meta.replace('"format_version": 1', '"format_version": 2')
+        )
+        with pytest.raises(ValueError) as ex:
+            ExpressionMatrix.load(path)
+        assert 'format version 2' in str(ex.value)
+
+class TestExpressionMatrixReadCsvs:
+
+    @pytest.fixture
+    def paths(self, tmp_path):
+        paths = {}
+        for i in range(3):
+            paths[f'matrix{i}'] = tmp_path / f'{i}.csv'
+            paths[f'matrix{i}'].write_text(f'gene,col1\ngene1,{i}\ngene2,1.5\n')
+        return paths
+
+    @pytest.mark.parametrize('n_jobs', (1, 2))
+    def test_read(self, paths, tmp_path, n_jobs):
+        matrices = ExpressionMatrix.read_csvs(
+            paths, directory=tmp_path / 'matrices', n_jobs=n_jobs
+        )
+        assert list(matrices) == ['matrix0', 'matrix1', 'matrix2']
+        for name, matrix in matrices.items():
+            assert matrix.name == name
+            assert_df_equals(matrix.data, ExpressionMatrix.read_csv(name, paths[name]).data)
+
+    def test_cache(self, paths, tmp_path):
+        cache = ParseCache(tmp_path / 'cache')
+        matrices = ExpressionMatrix.read_csvs(paths, cache=cache, n_jobs=2)
+        assert matrices['matrix2'].data.loc['gene1', 'col1'] == 2
+
+    def test_cache_once(self, paths, tmp_path, monkeypatch):
+        'Entries are looked up once per file, by the worker'
+        calls = []
+        original = ParseCache.get_entry
+        def get_entry(self, path, *args, **kwargs):
+            calls.append(path)
+            return original(self, path, *args, **kwargs)
+        monkeypatch.setattr(ParseCache, 'get_entry', get_entry)
+        ExpressionMatrix.read_csvs(paths, cache=ParseCache(tmp_path / 'cache'), n_jobs=1)
+        assert calls == list(paths.values())
+
+    def test_no_paths(self, tmp_path):
+        assert ExpressionMatrix.read_csvs({}, directory=tmp_path, n_jobs=2) == {}
+
+    def test_errors(self, paths, tmp_path):
+        'Collected per file'
+        paths['matrix1'].write_text('gene,col1\ngene1,nope\n')
+        paths['matrix2'].write_text('')
+        with pytest.raises(UserError) as ex:
+            ExpressionMatrix.read_csvs(paths, directory=tmp_path / 'matrices', n_jobs=2)
+        msg = str(ex.value)
+        assert f'{paths["matrix1"]}: Invalid float value' in msg
+        assert f'{paths["matrix2"]}: csv file is empty' in msg
+        assert str(paths['matrix0']) not in msg
+
+    def test_no_directory(self, paths):
+        with pytest.raises(ValueError) as ex:
+            ExpressionMatrix.read_csvs(paths)
+        assert 'directory or cache' in str(ex.value)
+
+class TestExpressionMatrixDerived:
+
+    'Matrices derived from a validated one are not validated again'
+
+    @pytest.fixture
+    def matrix(self):
+        return ExpressionMatrix(name='myname', data=pd.DataFrame(
+            [[1, 2, 3], [4, 5, 6], [7, 8, 9]], index=['a', 'b', 'c'],
+            columns=['x', 'y', 'z'], dtype=float
+        ))
+
+    @pytest.fixture(autouse=True)
+    def no_validation(self, matrix, monkeypatch):  # pylint: disable=unused-argument
+        def fail(*_):
+            raise AssertionError('Validated again')
+        monkeypatch.setattr(ExpressionMatrix, '_raise_if_duplicates', fail)
+
+    def test_subset(self, matrix):
+        subset = matrix.subset(rows=['c', 'a', 'a', 'nope'], columns=['z', 'x'])
+        assert subset.name == 'myname'
+        assert subset.data.index.tolist() == ['a', 'c']
+        assert subset.data.columns.tolist() == ['x', 'z']
+        assert subset.data.values.tolist() == [[1, 3], [7, 9]]
+
+    def test_astype(self, matrix):
+        actual = matrix.astype(np.float32)
+        assert (actual.data.dtypes == np.float32).all()
+        np.testing.assert_array_equal(actual.data.values, matrix.data.values)
+
+    def test_load(self, matrix, tmp_path):
+        matrix.save(tmp_path / 'matrix')
+        assert_df_equals(ExpressionMatrix.load(tmp_path / 'matrix').data, matrix.data)
+
+class TestExpressionMatrixBaits:
+
+    @pytest.fixture
+    def matrix(self):
+        return ExpressionMatrix(name='myname', data=pd.DataFrame(
+            np.random.rand(5, 4), index=[f'gene{i}' for i in range(5)]
+        ))
+
+    def test_get_bait_positions(self, matrix):
+        positions = matrix.get_bait_positions(['gene3', 'gene0'])
+        np.testing.assert_array_equal(positions, [3, 0])
+
+    def test_missing(self, matrix):
+        with pytest.raises(UserError) as ex:
+            matrix.get_bait_positions(['gene3', 'nope1', 'nope2'])
+        msg = str(ex.value)
+        assert 'myname' in msg
+        assert "'nope1', 'nope2'" in msg
+        assert 'gene3' not in msg
+
+    def test_pearson(self, matrix):
+        baits = ['gene4', 'gene1']
+        assert_df_equals(
+            matrix.pearson(baits, n_jobs=2),
+            pearson_df(matrix.data, matrix.data.loc[baits])
+        )
+
+class TestExpressionMatrixFromValues:
+
+    def test_keep_index_and_cols_as_str(self):
+        matrix = ExpressionMatrix._from_values(
+            name='myname', header=[1, 2], rows=[3], values=[[1.2]]
         )
         df = matrix.data
         assert df.index.name == '1'
@@ -296,13 +816,11 @@ class TestExpressionMatrixFromArray:
 
     def test_raise_if_duplicate_index(self):
         with pytest.raises(UserError) as ex:
-            ExpressionMatrix._from_array(
+            ExpressionMatrix._from_values(
                 name='myname',
-                data=np.array([
-                    ['gene', 'col1'],
-                    ['row1', 1.2],
-                    ['row1', 1.3],
-                ])
+                header=['gene', 'col1'],
+                rows=['row1', 'row1'],
+                values=[[1.2], [1.3]],
             )
         msg = str(ex.value)
         assert 'duplicate row names' in msg
@@ -311,12 +829,11 @@ class TestExpressionMatrixFromArray:
 
     def test_raise_if_duplicate_columns(self):
         with pytest.raises(UserError) as ex:
-            ExpressionMatrix._from_array(
+            ExpressionMatrix._from_values(
                 name='myname',
-                data=np.array([
-                    ['gene', 'col1', 'col1'],
-                    ['row1', 1.2, 1.3],
-                ])
+                header=['gene', 'col1', 'col1'],
+                rows=['row1'],
+                values=[[1.2, 1.3]],
             )
         msg = str(ex.value)
         assert 'duplicate column names' in msg
@@ -326,12 +843,9 @@ class TestExpressionMatrixFromArray:
     @pytest.mark.parametrize('value', ['1.000,2', '1,2'])
     def test_raise_if_invalid_float(self, value):
         with pytest.raises(UserError) as ex:
-            ExpressionMatrix._from_array(
-                name='myname',
-                data=np.array([
-                    ['gene', 'col1'],
-                    ['row1', value],
-                ])
+            ExpressionMatrix._from_values(
+                name='myname', header=['gene', 'col1'], rows=['row1'],
+                values=[[value]],
             )
         msg = str(ex.value)
         assert 'could not convert string to float' in msg
@@ -358,6 +872,10 @@ class TestPearson:
 
     'Test pearson against its automatically vectorised equivalent'
 
+    @pytest.fixture(autouse=True, params=('gemm', 'streaming'))
+    def algorithm(self, request):
+        self._algorithm = request.param
+
     def assert_pearson(self, data, indices):
         with warnings.catch_warnings():
             # Suppress division by zero warnings. For performance, vectorised
@@ -372,7 +890,7 @@ class TestPearson:
             # Calculate actual
             data_original = data.copy()
             indices_original = copy(indices)
-            actual = pearson(data, indices)
+            actual = pearson(data, indices, algorithm=self._algorithm)
             np.testing.assert_array_equal(data, data_original)
             assert indices == indices_original
 
@@ -416,16 +934,652 @@ class TestPearson:
 
     def test_data_empty(self, data):
         'When data is empty'
-        actual = pearson(np.empty((0, 0)), [])
+        actual = pearson(np.empty((0, 0)), [], algorithm=self._algorithm)
         assert not actual.size
         assert actual.shape == (0, 0)
 
     def test_data_empty_1d(self, data):
         'When data is empty and its shape is 1D, still return np.empty((0,0))'
-        actual = pearson(np.empty((0,)), [])
+        actual = pearson(np.empty((0,)), [], algorithm=self._algorithm)
         assert not actual.size
         assert actual.shape == (0, 0)
 
+def test_pearson_algorithms_agree():
+    'gemm and streaming agree within the documented tolerance'
+    data = np.random.rand(300, 50) * 1000
+    data[5] = 3.3  # a zero variance row gets NaN in both
+    indices = [0, 5, 7, 299]
+    with np.errstate(divide='ignore', invalid='ignore'):
+        streaming = pearson(data, indices, algorithm='streaming')
+    gemm = pearson(data, indices, algorithm='gemm')
+    assert np.isnan(gemm[5]).all()
+    np.testing.assert_allclose(gemm, streaming, rtol=0, atol=1e-12, equal_nan=True)
+
+class TestPearsonBlocks:
+
+    @pytest.mark.parametrize('block_rows', (1, 7, 10, 1000))
+    def test_same_as_pearson(self, block_rows):
+        'Blocks cover all rows in order and match pearson'
+        data = np.random.rand(10, 20)
+        indices = [3, 1, 3]
+        blocks = list(pearson_blocks(data, indices, block_rows=block_rows))
+        assert all(block.shape[0] <= block_rows for _, block in blocks)
+        assert [rows.start for rows, _ in blocks] == list(range(0, 10, block_rows))
+        actual = np.concatenate([block for _, block in blocks])
+        np.testing.assert_allclose(actual, pearson(data, indices))
+
+    def test_subset_empty(self):
+        blocks = list(pearson_blocks(np.random.rand(5, 3), [], block_rows=2))
+        assert [block.shape for _, block in blocks] == [(2, 0), (2, 0), (1, 0)]
+
+    def test_invalid_block_rows(self):
+        with pytest.raises(ValueError) as ex:
+            list(pearson_blocks(np.random.rand(5, 3), [0], block_rows=0))
+        assert 'block_rows' in str(ex.value)
+
+class TestPearsonEdges:
+
+    'Test pearson_edges against filtering the dense pearson matrix'
+
+    @pytest.fixture
+    def data(self):
+        data = np.random.rand(50, 10)
+        data[3] = 1  # NaN correlations are never kept
+        return data
+
+    indices = [0, 10, 3, 49]
+
+    def dense(self, data, absolute):
+        with np.errstate(invalid='ignore'):
+            dense = pearson(data, self.indices)
+        return np.abs(dense) if absolute else dense
+
+    def assert_edges(self, actual, data):
+        rows, columns, correlations = actual
+        assert (np.lexsort((columns, rows)) == np.arange(len(rows))).all()
+        np.testing.assert_allclose(correlations, pearson(data, self.indices)[rows, columns])
+
+    @pytest.mark.parametrize('absolute', (False, True))
+    def test_threshold(self, data, absolute):
+        actual = pearson_edges(
+            data, self.indices, threshold=0.3, absolute=absolute, block_rows=7
+        )
+        self.assert_edges(actual, data)
+        rows, columns, _ = actual
+        with np.errstate(invalid='ignore'):
+            expected = np.nonzero(self.dense(data, absolute) >= 0.3)
+        np.testing.assert_array_equal(rows, expected[0])
+        np.testing.assert_array_equal(columns, expected[1])
+
+    @pytest.mark.parametrize('absolute', (False, True))
+    def test_top_k(self, data, absolute):
+        actual = pearson_edges(
+            data, self.indices, top_k=5, absolute=absolute, block_rows=7
+        )
+        self.assert_edges(actual, data)
+        rows, columns, _ = actual
+        dense = np.nan_to_num(self.dense(data, absolute), nan=-np.inf)
+        for column in range(len(self.indices)):
+            expected = np.sort(dense[:, column])[::-1][:5]
+            kept = np.sort(dense[rows[columns == column], column])[::-1]
+            if column == 2:
+                # The bait with NaN correlations has none
+                assert not kept.size
+            else:
+                np.testing.assert_allclose(kept, expected)
+
+    def test_top_k_and_threshold(self, data):
+        'top_k edges of those passing the threshold'
+        rows, columns, correlations = pearson_edges(
+            data, self.indices, threshold=0.2, top_k=3
+        )
+        assert (correlations >= 0.2).all()
+        assert (np.bincount(columns, minlength=len(self.indices)) <= 3).all()
+        expected_count = sum(
+            min(3, (self.dense(data, False)[:, column] >= 0.2).sum())
+            for column in range(len(self.indices))
+        )
+        assert len(rows) == expected_count
+
+    def test_no_filter(self, data):
+        with pytest.raises(ValueError) as ex:
+            pearson_edges(data, self.indices)
+        assert 'threshold or top_k' in str(ex.value)
+
+def test_pearson_df_edges():
+    data = pd.DataFrame(
+        [[1, 2, 3], [3, 2, 1], [1, 2, 1], [1, 2, 3.1]],
+        index=['a', 'b', 'c', 'd'], dtype=float
+    )
+    actual = pearson_df_edges(data, data.loc[['b', 'a']], threshold=0.5)
+    assert actual.columns.tolist() == ['gene', 'bait', 'r']
+    assert list(zip(actual['gene'], actual['bait'])) == [
+        ('a', 'a'), ('b', 'b'), ('d', 'a')
+    ]
+    np.testing.assert_allclose(actual['r'], [1, 1, 0.99962], atol=1e-5)
+
+class TestPearsonNJobs:
+
+    @pytest.mark.parametrize('n_jobs', (2, 3, -1))
+    def test_same_as_single_threaded(self, n_jobs):
+        data = np.random.rand(100, 10)
+        indices = [0, 50, 99]
+        np.testing.assert_allclose(
+            pearson(data, indices, n_jobs=n_jobs),
+            pearson(data, indices)
+        )
+
+    def test_blocks_in_order(self):
+        data = np.random.rand(100, 10)
+        blocks = list(pearson_blocks(data, [1, 2], block_rows=9, n_jobs=4))
+        assert [rows.start for rows, _ in blocks] == list(range(0, 100, 9))
+        np.testing.assert_allclose(
+            np.concatenate([block for _, block in blocks]),
+            pearson(data, [1, 2])
+        )
+
+    def test_invalid(self):
+        with pytest.raises(ValueError) as ex:
+            pearson(np.random.rand(3, 3), [0], n_jobs=0)
+        assert 'n_jobs' in str(ex.value)
+
+    def test_streaming_unsupported(self):
+        with pytest.raises(ValueError) as ex:
+            pearson(np.random.rand(3, 3), [0], algorithm='streaming', n_jobs=2)
+        assert 'gemm' in str(ex.value)
+
+class TestPearsonPairwise:
+
+    'Test missing=\'pairwise\' against pandas\' pairwise-complete corr'
+
+    @pytest.fixture
+    def data(self):
+        data = np.random.rand(40, 12)
+        data[np.random.rand(*data.shape) < 0.2] = np.nan
+        data[5] = np.nan
+        return data
+
+    indices = [0, 5, 20, 39]
+
+    def expected(self, data, min_overlap=1):
+        return pd.DataFrame(data.T).corr(min_periods=min_overlap).values[:, self.indices]
+
+    def test_matches_pandas(self, data):
+        actual = pearson(data, self.indices, missing='pairwise')
+        np.testing.assert_allclose(actual, self.expected(data), atol=1e-12)
+
+    def test_min_overlap(self, data):
+        actual = pearson(data, self.indices, missing='pairwise', min_overlap=9)
+        np.testing.assert_allclose(actual, self.expected(data, 9), atol=1e-12)
+
+    def test_no_missing(self):
+        'Same as without missing values'
+        data = np.random.rand(30, 10)
+        np.testing.assert_allclose(
+            pearson(data, self.indices[:3], missing='pairwise'),
+            pearson(data, self.indices[:3]),
+            atol=1e-12
+        )
+
+    def test_blocks(self, data):
+        blocks = pearson_blocks(
+            data, self.indices, block_rows=7, missing='pairwise', n_jobs=2
+        )
+        actual = np.concatenate([block for _, block in blocks])
+        np.testing.assert_allclose(actual, self.expected(data), atol=1e-12)
+
+    def test_constant_on_overlap(self):
+        'A row constant on its overlap with a bait is undefined, not noise'
+        data = np.array([
+            [0.1, 0.1, 0.1, 0.7, 0.9],
+            [1, 2, 3, np.nan, np.nan],
+            [0.3, 0.7, 0.3, 0.3, np.nan],
+        ])
+        actual = pearson(data, [1, 2], missing='pairwise')
+        assert np.isnan(actual[0, 0])
+        assert actual[1, 0] == pytest.approx(1)
+        assert actual[2, 1] == pytest.approx(1)
+        assert actual[2, 0] == pytest.approx(0, abs=1e-12)
+
+    def test_unknown(self, data):
+        with pytest.raises(ValueError) as ex:
+            pearson(data, self.indices, missing='drop')
+        assert 'drop' in str(ex.value)
+
+    def test_streaming_unsupported(self, data):
+        with pytest.raises(ValueError) as ex:
+            pearson(data, self.indices, algorithm='streaming', missing='pairwise')
+        assert 'gemm' in str(ex.value)
+
+class TestPearsonBatch:
+
+    def test_same_as_pearson(self):
+        data = np.random.rand(30, 8)
+        index_sets = [[0, 5], [5, 29, 0], [], slice(10, 13), [7]]
+        actual = list(pearson_batch(data, index_sets))
+        assert len(actual) == len(index_sets)
+        for correlations, indices in zip(actual, index_sets):
+            np.testing.assert_allclose(correlations, pearson(data, indices))
+
+    def test_one_pass(self, monkeypatch):
+        'pearson is called once, on the union'
+        calls = []
+        original = varbio._various.pearson
+        def pearson_(data, indices, **kwargs):
+            calls.append(list(indices))
+            return original(data, indices, **kwargs)
+        monkeypatch.setattr('varbio._various.pearson', pearson_)
+        list(pearson_batch(np.random.rand(10, 4), [[3, 1], [1, 8]]))
+        assert calls == [[1, 3, 8]]
+
+    def test_df(self):
+        data = pd.DataFrame(
+            np.random.rand(10, 4), index=[f'gene{i}' for i in range(10)]
+        )
+        bait_sets = [['gene3', 'gene1'], ['gene9']]
+        for actual, baits in zip(pearson_df_batch(data, bait_sets), bait_sets):
+            assert_df_equals(actual, pearson_df(data, data.loc[baits]))
+
+    def test_df_missing_bait(self):
+        data = pd.DataFrame(np.random.rand(3, 4), index=['a', 'b', 'c'])
+        with pytest.raises(KeyError) as ex:
+            list(pearson_df_batch(data, [['a'], ['b', 'nope']]))
+        assert "'nope'" in str(ex.value)
+
+class TestPearsonAccumulator:
+
+    @pytest.fixture
+    def data(self):
+        return np.random.rand(20, 15)
+
+    indices = [0, 7, 19]
+
+    def test_update(self, data):
+        'Same as pearson of all columns, no matter how they are added'
+        accumulator = PearsonAccumulator.from_data(data[:, :4], self.indices)
+        accumulator.update(data[:, 4:5])
+        accumulator.update(data[:, 5:5])
+        accumulator.update(data[:, 5:])
+        assert accumulator.count == 15
+        np.testing.assert_allclose(
+            accumulator.result(), pearson(data, self.indices), atol=1e-12
+        )
+
+    def test_from_data(self, data):
+        np.testing.assert_allclose(
+            PearsonAccumulator.from_data(data, self.indices).result(),
+            pearson(data, self.indices), atol=1e-12
+        )
+
+    def test_save_load(self, data, tmp_path):
+        accumulator = PearsonAccumulator.from_data(data[:, :10], self.indices)
+        accumulator.save(tmp_path / 'accumulator')
+        accumulator = PearsonAccumulator.load(tmp_path / 'accumulator')
+        accumulator.update(data[:, 10:])
+        np.testing.assert_allclose(
+            accumulator.result(), pearson(data, self.indices), atol=1e-12
+        )
+
+    def test_constant_row(self, data):
+        'NaN like pearson, not rounding error'
+        data[7] = 0.1
+        accumulator = PearsonAccumulator.from_data(data[:, :4], self.indices)
+        accumulator.update(data[:, 4:])
+        actual = accumulator.result()
+        assert np.isnan(actual[7]).all()
+        assert np.isnan(actual[:, 1]).all()
+        np.testing.assert_allclose(actual, pearson(data, self.indices), atol=1e-12)
+
+    def test_wrong_row_count(self, data):
+        accumulator = PearsonAccumulator.from_data(data, self.indices)
+        with pytest.raises(ValueError) as ex:
+            accumulator.update(data[1:])
+        assert '20 rows' in str(ex.value)
+
+class TestPearsonOutOfCore:
+
+    @pytest.fixture
+    def data(self):
+        return np.random.rand(100, 10)
+
+    indices = [0, 50, 99]
+
+    def test_memmap(self, data, tmp_path):
+        'Memory mapped data and correlations, a few rows at a time'
+        matrix = ExpressionMatrix(name='matrix', data=pd.DataFrame(
+            data, index=[f'gene{i}' for i in range(100)]
+        ))
+        matrix.save(tmp_path / 'matrix')
+        values = ExpressionMatrix.load(tmp_path / 'matrix').data.values
+        out = np.lib.format.open_memmap(
+            str(tmp_path / 'out.npy'), mode='w+', shape=(100, 3)
+        )
+        actual = pearson(values, self.indices, out=out, max_memory=2000, n_jobs=2)
+        assert actual is out
+        np.testing.assert_allclose(
+            np.load(str(tmp_path / 'out.npy')), pearson(data, self.indices)
+        )
+
+    def test_df(self, data):
+        data = pd.DataFrame(data)
+        out = np.empty((100, 3), dtype=np.float32)
+        actual = pearson_df(data, data.iloc[self.indices], out=out)
+        assert actual.dtypes.eq(np.float32).all()
+        out[0, 0] = 2
+        assert actual.iloc[0, 0] == 2  # not copied
+
+    def test_max_memory_too_small(self, data):
+        with pytest.raises(ValueError) as ex:
+            pearson(data, self.indices, max_memory=100)
+        assert 'max_memory' in str(ex.value)
+
+    def test_result_counts(self, data):
+        'Without out, the result counts towards max_memory'
+        pearson(data, self.indices, out=np.empty((100, 3)), max_memory=1500)
+        with pytest.raises(ValueError) as ex:
+            pearson(data, self.indices, max_memory=1500)
+        assert 'max_memory' in str(ex.value)
+
+    def test_pairwise(self, data):
+        'Pairwise takes more memory per row, but gives the same result'
+        data[np.random.rand(*data.shape) < 0.2] = np.nan
+        np.testing.assert_allclose(
+            pearson(data, self.indices, missing='pairwise', max_memory=5000),
+            pearson(data, self.indices, missing='pairwise'),
+        )
+        with pytest.raises(ValueError) as ex:
+            pearson(data, self.indices, missing='pairwise', max_memory=1200)
+        assert 'max_memory' in str(ex.value)
+
+    def test_wrong_out(self, data):
+        with pytest.raises(ValueError) as ex:
+            pearson(data, self.indices, out=np.empty((100, 2)))
+        assert 'shape' in str(ex.value)
+
+class TestPearsonAll:
+
+    'Test all-pairs correlations against the dense pearson matrix'
+
+    @pytest.fixture
+    def data(self):
+        data = np.random.rand(30, 8)
+        data[4] = 1  # NaN correlations
+        return data
+
+    def dense(self, data, absolute=False):
+        with np.errstate(invalid='ignore'):
+            dense = pearson(data, np.arange(len(data)))
+        return np.abs(dense) if absolute else dense
+
+    @pytest.mark.parametrize('block_rows', (7, 30, 100))
+    def test_packed(self, data, block_rows):
+        actual = pearson_all(data, block_rows=block_rows, n_jobs=2)
+        expected = self.dense(data)[np.triu_indices(len(data), 1)]
+        np.testing.assert_allclose(actual, expected, atol=1e-12)
+
+    @pytest.mark.parametrize('absolute', (False, True))
+    def test_threshold(self, data, absolute):
+        rows, columns, correlations = pearson_all_edges(
+            data, threshold=0.3, absolute=absolute, block_rows=7
+        )
+        dense = self.dense(data, absolute)
+        with np.errstate(invalid='ignore'):
+            expected = np.nonzero(np.triu(dense >= 0.3, 1))
+        np.testing.assert_array_equal(rows, expected[0])
+        np.testing.assert_array_equal(columns, expected[1])
+        np.testing.assert_allclose(correlations, self.dense(data)[rows, columns], atol=1e-12)
+
+    def test_top_k(self, data):
+        rows, columns, correlations = pearson_all_edges(data, top_k=3, block_rows=7)
+        dense = np.nan_to_num(self.dense(data), nan=-np.inf)
+        np.fill_diagonal(dense, -np.inf)
+        expected = set()
+        for i, row in enumerate(dense):
+            for j in np.argsort(row)[::-1][:3]:
+                if row[j] > -np.inf:
+                    expected.add((min(i, j), max(i, j)))
+        assert sorted(zip(rows, columns)) == list(zip(rows, columns))
+        assert set(zip(rows, columns)) == expected
+        np.testing.assert_allclose(correlations, dense[rows, columns], atol=1e-12)
+
+    def test_matrix(self, data):
+        matrix = ExpressionMatrix(name='myname', data=pd.DataFrame(
+            data, index=[f'gene{i}' for i in range(len(data))]
+        ))
+        edges = matrix.pearson_all_edges(threshold=0.5)
+        assert edges.columns.tolist() == ['gene1', 'gene2', 'r']
+        rows, columns, _ = pearson_all_edges(data, threshold=0.5)
+        assert edges['gene1'].tolist() == [f'gene{i}' for i in rows]
+        assert edges['gene2'].tolist() == [f'gene{i}' for i in columns]
+
+class TestMetaPearson:
+
+    'Test meta_pearson against aggregating pearson_df of each matrix'
+
+    @pytest.fixture
+    def matrices(self):
+        def matrix(name, genes, samples):
+            return ExpressionMatrix(name=name, data=pd.DataFrame(
+                np.random.rand(len(genes), samples), index=pd.Index(genes, name='gene')
+            ))
+        return [
+            matrix('matrix1', ['a', 'b', 'c', 'd'], 8),
+            matrix('matrix2', ['c', 'e', 'a', 'f', 'b'], 12),
+            matrix('matrix3', ['e', 'f', 'g'], 10),  # has only bait e
+        ]
+
+    baits = ['a', 'e']
+
+    def expected(self, matrices):
+        'Per matrix correlations aligned to all genes and baits'
+        genes = ['a', 'b', 'c', 'd', 'e', 'f', 'g']
+        correlations = []
+        for matrix in matrices:
+            baits = [bait for bait in self.baits if bait in matrix.data.index]
+            df = pearson_df(matrix.data, matrix.data.loc[baits])
+            correlations.append(df.reindex(index=genes, columns=self.baits).values)
+        return genes, np.array(correlations)
+
+    def test_aggregates(self, matrices):
+        actual = meta_pearson(matrices, self.baits, threshold=0.2, block_rows=2)
+        genes, correlations = self.expected(matrices)
+        for df in (actual.mean, actual.combined, actual.count, actual.count_above):
+            assert df.index.tolist() == genes
+            assert df.index.name == 'gene'
+            assert df.columns.tolist() == self.baits
+        np.testing.assert_array_equal(actual.count, (~np.isnan(correlations)).sum(axis=0))
+        with warnings.catch_warnings():
+            warnings.simplefilter('ignore', RuntimeWarning)  # all NaN
+            np.testing.assert_allclose(actual.mean, np.nanmean(correlations, axis=0))
+        with np.errstate(invalid='ignore'):
+            np.testing.assert_array_equal(
+                actual.count_above, (correlations >= 0.2).sum(axis=0)
+            )
+
+        weights = np.array([5, 9, 7])[:, np.newaxis, np.newaxis] * ~np.isnan(correlations)
+        z = np.arctanh(np.clip(np.nan_to_num(correlations), -0.999999, 0.999999))
+        with np.errstate(invalid='ignore'):
+            expected = np.tanh((weights * z).sum(axis=0) / weights.sum(axis=0))
+        np.testing.assert_allclose(actual.combined, expected, atol=1e-5)
+
+    def test_no_threshold(self, matrices):
+        assert meta_pearson(matrices, self.baits).count_above is None
+
+    def test_missing_bait(self, matrices):
+        with pytest.raises(UserError) as ex:
+            meta_pearson(matrices, ['a', 'nope'])
+        assert "'nope'" in str(ex.value)
+
+class TestPearsonPermutationTest:
+
+    @pytest.fixture
+    def data(self):
+        data = np.random.rand(30, 12)
+        data[1] = data[0] * 2 + 1  # perfectly correlated with bait 0
+        data[2] = 1  # NaN correlations
+        return data
+
+    indices = [0, 10]
+
+    def test_p_values(self, data):
+        correlations, p_values = pearson_permutation_test(
+            data, self.indices, permutations=99, seed=1
+        )
+        with np.errstate(invalid='ignore'):
+            np.testing.assert_allclose(correlations, pearson(data, self.indices))
+        assert np.isnan(p_values[2]).all()
+        p_values = np.delete(p_values, 2, axis=0)
+        assert ((p_values >= 0.01) & (p_values <= 1)).all()
+        # Only permutations which keep the order of all 12 values would get a
+        # null correlation of 1, which is very unlikely
+        assert p_values[1, 0] == 0.01
+
+    def test_reproducible(self, data):
+        'Same seed, same result, regardless of n_jobs'
+        kwargs = dict(permutations=50, seed=3)
+        _, expected = pearson_permutation_test(data, self.indices, **kwargs)
+        _, actual = pearson_permutation_test(data, self.indices, n_jobs=3, **kwargs)
+        np.testing.assert_array_equal(actual, expected)
+
+    def test_df(self, data):
+        data = pd.DataFrame(data, index=[f'gene{i}' for i in range(len(data))])
+        correlations, p_values = pearson_df_permutation_test(
+            data, data.iloc[self.indices], permutations=10, seed=1
+        )
+        assert correlations.columns.tolist() == ['gene0', 'gene10']
+        assert p_values.index.equals(data.index)
+
+    def test_invalid_permutations(self, data):
+        with pytest.raises(ValueError) as ex:
+            pearson_permutation_test(data, self.indices, permutations=0)
+        assert 'permutations' in str(ex.value)
+
+class TestSpearman:
+
+    'Test spearman against pandas\' spearman corr'
+
+    @pytest.fixture
+    def data(self):
+        data = np.random.rand(40, 12)
+        data[3, :6] = 0.5  # ties
+        return data
+
+    indices = [0, 3, 39]
+
+    def expected(self, data):
+        return pd.DataFrame(data.T).corr(method='spearman').values[:, self.indices]
+
+    def test_matches_pandas(self, data):
+        np.testing.assert_allclose(
+            spearman(data, self.indices, n_jobs=2), self.expected(data), atol=1e-12
+        )
+
+    def test_edges(self, data):
+        'method=spearman on the blocked engine'
+        rows, columns, correlations = pearson_edges(
+            data, self.indices, threshold=0.2, method='spearman', block_rows=7
+        )
+        expected = self.expected(data)
+        np.testing.assert_allclose(correlations, expected[rows, columns], atol=1e-12)
+        assert len(rows) == (expected >= 0.2).sum()
+
+    def test_df(self):
+        data = pd.DataFrame(
+            [[1, 2, 3], [3, 2, 1], [1, 10, 100]], index=['a', 'b', 'c'], dtype=float
+        )
+        actual = spearman_df(data, data.loc[['c']])
+        np.testing.assert_allclose(actual['c'], [1, -1, 1])
+
+    def test_missing_unsupported(self, data):
+        with pytest.raises(ValueError) as ex:
+            list(pearson_blocks(data, self.indices, method='spearman', missing='pairwise'))
+        assert 'spearman' in str(ex.value)
+
+class TestPearsonFloat32:
+
+    @pytest.fixture
+    def data(self):
+        return np.random.rand(100, 20)
+
+    indices = [0, 50, 99]
+
+    def test_close_to_float64(self, data):
+        actual = pearson(data, self.indices, dtype=np.float32)
+        assert actual.dtype == np.float32
+        np.testing.assert_allclose(actual, pearson(data, self.indices), atol=1e-5)
+
+    def test_follows_input_dtype(self, data):
+        assert pearson(data.astype(np.float32), self.indices).dtype == np.float32
+        assert pearson(data, self.indices).dtype == np.float64
+
+    def test_blocks(self, data):
+        blocks = pearson_blocks(data, self.indices, block_rows=30, dtype=np.float32)
+        for _, block in blocks:
+            assert block.dtype == np.float32
+
+    def test_invalid(self, data):
+        with pytest.raises(ValueError) as ex:
+            pearson(data, self.indices, dtype=np.int32)
+        assert 'float32 or float64' in str(ex.value)
+
+class TestStandardisedMatrix:
+
+    @pytest.fixture
+    def matrix(self):
+        data = pd.DataFrame(
+            np.random.rand(30, 8), index=[f'gene{i}' for i in range(30)]
+        )
+        return ExpressionMatrix(name='mymatrix', data=data)
+
+    def test_pearson_df(self, matrix):
+        'Same as pearson_df'
+        baits = ['gene3', 'gene0', 'gene29']
+        actual = matrix.prepare_correlation().pearson_df(baits)
+        expected = pearson_df(matrix.data, matrix.data.loc[baits])
+        assert actual.index.equals(expected.index)
+        assert actual.columns.equals(expected.columns)
+        np.testing.assert_allclose(actual.values, expected.values)
+
+    def test_pearson(self, matrix):
+        prepared = matrix.prepare_correlation()
+        assert not prepared.values.flags.writeable
+        np.testing.assert_allclose(
+            prepared.pearson([1, 2], n_jobs=2),
+            pearson(matrix.data.values, [1, 2])
+        )
+
+    def test_float32(self, matrix):
+        prepared = matrix.prepare_correlation(dtype=np.float32)
+        actual = prepared.pearson([1, 2])
+        assert actual.dtype == np.float32
+        np.testing.assert_allclose(
+            actual, pearson(matrix.data.values, [1, 2]), atol=1e-5
+        )
+
+    def test_follows_dtype(self, matrix):
+        'float32 data stays float32 by default'
+        matrix = matrix.astype(np.float32)
+        assert matrix.prepare_correlation().values.dtype == np.float32
+
+    def test_no_columns(self):
+        matrix = ExpressionMatrix.from_dict({'name': 'mymatrix', 'data': [
+            ['gene'], ['gene1'], ['gene2'],
+        ]})
+        prepared = matrix.prepare_correlation()
+        assert prepared.values.shape == (2, 0)
+        assert np.isnan(prepared.pearson([0, 1])).all()
+
+    def test_missing_bait(self, matrix):
+        with pytest.raises(KeyError) as ex:
+            matrix.prepare_correlation().pearson_df(['gene1', 'nope'])
+        assert "'nope'" in str(ex.value)
+        assert 'gene1' not in str(ex.value)
+
+def test_pearson_unknown_algorithm():
+    with pytest.raises(ValueError) as ex:
+        pearson(np.random.rand(3, 3), [0], algorithm='magic')
+    assert 'magic' in str(ex.value)
+
 class TestPearsonDf:
 
     @pytest.fixture(scope='session')
@@ -439,7 +1593,7 @@ class TestPearsonDf:
     def mock_pearson(self, monkeypatch):
         # We only need to test the df wrapper part, not the vectorised pearson
         # calculation itself, so replace it with something simple
-        def vectorised(data, indices):
+        def vectorised(data, indices, **kwargs):  # pylint: disable=unused-argument
             if not data.size or len(indices) == 0:
                 return np.empty((0, 0))
             return np.dot(data, data[indices].T + 1)
@@ -18,9 +18,12 @@
 
 __version__ = '3.0.0'
 
-from ._util import UserError, join_lines, open_text
+from ._util import UserError, join_lines, open_text, ParseCache, span
 from ._various import (
-    ExpressionMatrix, parse_yaml, pearson, pearson_df,
-    parse_baits, init_logging
+    ExpressionMatrix, parse_yaml, pearson, pearson_blocks, pearson_edges,
+    pearson_batch, pearson_permutation_test, pearson_all, pearson_all_edges,
+    pearson_df, pearson_df_edges, pearson_df_batch, pearson_df_permutation_test,
+    spearman, spearman_df, meta_pearson, parse_baits, init_logging,
+    StandardisedMatrix, PearsonAccumulator, MetaCorrelation
 )
 from ._csv import parse_csv
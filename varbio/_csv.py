@@ -15,73 +15,170 @@
 # You should have received a copy of the GNU Lesser General Public License
 # along with varbio.  If not, see <http://www.gnu.org/licenses/>.
 
+from itertools import chain, islice
 from textwrap import dedent
 import csv
-import io
 import logging
+import time
 
-from varbio._util import open_text, UserError, join_lines
+import pandas as pd
 
+from varbio import __version__
+from varbio._util import open_text, UserError, join_lines, span
 
-def parse_csv(path):
+
+def parse_csv(path, sniff_lines=100, sniff_chars=2**16, engine='python',
+              cache=None, sample_size=2**20):
     '''
     Robustly parse csv
 
+    The csv dialect is autodetected from a sample of the first non-empty
+    lines, then the file is parsed as it is read, so only the sample and the
+    current row are kept in memory. This keeps autodetection time constant
+    regardless of the file size.
+
     Parameters
     ----------
     path : ~pathlib.Path
+    sniff_lines : int or None
+        Maximum number of non-empty lines to sample, None for no maximum.
+    sniff_chars : int or None
+        Stop sampling lines once they contain this many characters, None for
+        no maximum. At least 2 lines are sampled regardless of their size.
+        Setting both to None autodetects based on the whole file, which is
+        slow on large files.
+    engine : str
+        ``'python'`` to parse with the `csv` module. ``'pandas'`` to parse
+        with pandas' C engine instead, which is faster on large files. Its
+        output and errors are the same: when it gets input it can't handle
+        the same way, e.g. an inconsistent column count or an empty value, the
+        file is parsed again from the start with the ``'python'`` engine,
+        skipping the rows already yielded. So a bad line near the end of the
+        file costs about two full parses. zstd compressed files are always
+        parsed with the ``'python'`` engine, see `open_text`.
+    cache : ParseCache or None
+        If not None, get the rows from this cache, parsing only on a miss. A
+        hit still loads all rows into memory as lists of str at once. To read
+        a large matrix, use `ExpressionMatrix.read_csv` with a cache instead,
+        which memory maps the values.
+    sample_size : int or None
+        Maximum number of bytes to detect the encoding from, see `open_text`.
 
     Yields
     ------
     CSV rows, header included as lists. All values are str with outer
     whitespace stripped.
     '''
+    if engine not in ('python', 'pandas'):
+        raise ValueError(f'Unknown engine: {engine!r}')
+
+    if cache is not None:
+        # The engine doesn't affect the result
+        options = {
+            'sniff_lines': sniff_lines, 'sniff_chars': sniff_chars,
+            'sample_size': sample_size,
+        }
+        yield from cache.get(
+            path, 'parse_csv', __version__, options,
+            lambda: list(parse_csv(
+                path, sniff_lines, sniff_chars, engine, sample_size=sample_size
+            ))
+        )
+        return
+
+    # Only time the parsing, not what the consumer does in between rows
+    rows = _parse_csv(path, sniff_lines, sniff_chars, engine, sample_size)
+    with span('parse_csv', path=str(path), engine=engine) as fields:
+        fields.update(rows=0, seconds=0)
+        while True:
+            start = time.perf_counter()
+            row = next(rows, None)
+            fields['seconds'] += time.perf_counter() - start
+            if row is None:
+                break
+            fields['rows'] += 1
+            yield row
+
+def _parse_csv(path, sniff_lines, sniff_chars, engine, sample_size):
     # Remove empty lines up front, otherwise the sniffer fails to detect
     # the right/any delimiter sometimes.
-    with open_text(path) as f:
-        line_numbers = []
-        lines = []
-        for line_number, line in _read_non_empty_lines(f):
-            line_numbers.append(line_number)
-            lines.append(line)
-        text = '\n'.join(lines)
-
-    if not lines:
-        raise UserError(join_lines(
-            '''
-            csv file is empty (except for maybe some whitespace). It must
-            contain at least a header line'
-            '''
+    with open_text(path, sample_size) as f:
+        lines = _read_non_empty_lines(f)
+        sample = _read_sample(lines, sniff_lines, sniff_chars)
+
+        if not sample:
+            raise UserError(join_lines(
+                '''
+                csv file is empty (except for maybe some whitespace). It must
+                contain at least a header line'
+                '''
+            ))
+
+        dialect = _detect_dialect([line for _, line in sample])
+        logging.info(dedent(f'''\
+            Detected csv dialect of {path}:
+            delimiter {dialect.delimiter!r}
+            quotechar {dialect.quotechar!r}
+            doublequote {dialect.doublequote!r}
+            quoting {dialect.quoting!r}
+            escapechar {dialect.escapechar!r}'''
         ))
 
-    dialect = _detect_dialect(text, lines)
-    logging.info(dedent(f'''\
-        Detected csv dialect of {path}:
-        delimiter {dialect.delimiter!r}
-        quotechar {dialect.quotechar!r}
-        doublequote {dialect.doublequote!r}
-        quoting {dialect.quoting!r}
-        escapechar {dialect.escapechar!r}'''
-    ))
+        # pandas has to start over, which requires seeking
+        if engine == 'python' or not f.seekable():
+            yield from _parse(chain(sample, lines), dialect)
+            return
+
+        f.seek(0)
+        column_count = len(next(csv.reader([sample[0][1]], dialect)))
+        yielded = 0
+        try:
+            for row in _parse_pandas(f, dialect, column_count):
+                yield row
+                yielded += 1
+            return
+        except _FallBack as ex:
+            logging.debug(
+                f'Falling back to python engine after row {yielded} of {path}: '
+                f'{ex.__cause__ or ex}'
+            )
 
-    yield from _parse(text, lines, line_numbers, dialect)
+    # Let the python engine raise its user friendly error, or handle the input
+    # pandas can't, e.g. whitespace only lines. Rows already yielded are skipped.
+    with open_text(path, sample_size) as f:
+        yield from islice(_parse(_read_non_empty_lines(f), dialect), yielded, None)
+
+def _read_sample(lines, max_lines, max_chars):
+    sample = []
+    chars = 0
+    for line_number, line in lines:
+        sample.append((line_number, line))
+        chars += len(line)
+        if len(sample) < 2:
+            continue
+        if max_lines is not None and len(sample) >= max_lines:
+            break
+        if max_chars is not None and chars >= max_chars:
+            break
+    return sample
 
-def _detect_dialect(text, lines):
+def _detect_dialect(lines):
     # Possible delimiters have to be specified, otherwise it can pick any char
     # as delimiter, e.g. 'e'.
     delimiters = ';,\t| '
     sniffer = csv.Sniffer()
     try:
-        return sniffer.sniff(text, delimiters)
+        return _sniff(sniffer, lines, delimiters)
     except csv.Error as ex:
         logging.warning(join_lines(
             f'''
-            Failed to autodetect csv format based on whole file, retrying with
-            just the first 2 (non-empty) lines. Autodetect error: {ex}
+            Failed to autodetect csv format based on the first {len(lines)}
+            (non-empty) lines, retrying with just the first 2 (non-empty)
+            lines. Autodetect error: {ex}
             '''
         ))
         try:
-            return sniffer.sniff('\n'.join(lines[:2]), delimiters)
+            return _sniff(sniffer, lines[:2], delimiters)
         except csv.Error as ex:
             msg = (
                 f'''
@@ -93,18 +190,43 @@ def _detect_dialect(text, lines):
             )
             raise UserError(msg) from ex
 
-def _parse(text, lines, line_numbers, dialect):
-    def get_line():
-        # line_num is not the same as using enumerate if a csv row can span
-        # multiple lines; which isn't the case with our inputs though, but no
-        # reason not to use line_num (1-based)
-        return lines[reader.line_num - 1]
+def _sniff(sniffer, lines, delimiters):
+    '''
+    Sniff dialect and check we can be confident about it
+
+    The sniffer picks the most plausible dialect even when none fits well,
+    e.g. when a row in the sample has a different amount of columns.
+    '''
+    dialect = sniffer.sniff('\n'.join(lines), delimiters)
+    column_counts = set(map(len, csv.reader(lines, dialect)))
+    if len(column_counts) != 1 or column_counts.pop() < 2:
+        raise csv.Error(
+            f'Delimiter {dialect.delimiter!r} does not split all sampled lines '
+            'into the same amount of columns (of at least 2)'
+        )
+    return dialect
+
+def _parse(lines, dialect):
+    '''
+    Parse csv lines
+
+    Parameters
+    ----------
+    lines : ~typing.Iterable[~typing.Tuple[int, str]]
+        Line number and line of each non-empty line.
+    dialect : csv.Dialect
+    '''
+    # The line the reader last read. It's the line of the current row as a
+    # row can span multiple lines only if it has a quoted newline, which isn't
+    # the case with our inputs; else it's the last line of the row.
+    line_number = line = None
 
-    def get_line_number():
-        return line_numbers[reader.line_num - 1]
+    def read_lines():
+        nonlocal line_number, line
+        for line_number, line in lines:
+            yield line + '\n'
 
-    f = io.StringIO(text)
-    reader = csv.reader(f, dialect)
+    reader = csv.reader(read_lines(), dialect)
     col_count = None
     for row in reader:
         if not col_count:
@@ -112,8 +234,8 @@ def _parse(text, lines, line_numbers, dialect):
 
         if len(row) != col_count:
             raise UserError(
-                f'Line {get_line_number()} (1-based) has {len(row)} columns, '
-                f'expected {col_count}. Line:\n{get_line()}'
+                f'Line {line_number} (1-based) has {len(row)} columns, '
+                f'expected {col_count}. Line:\n{line}'
             )
 
         row = [value.strip() for value in row]
@@ -121,14 +243,54 @@ def _parse(text, lines, line_numbers, dialect):
         for col, value in enumerate(row, start=1):
             if not value:
                 raise UserError(
-                    f'Line {get_line_number()}, column {col} (1-based) is empty (or '
-                    f'is whitespace); it must have a value. Line:\n{get_line()}'
+                    f'Line {line_number}, column {col} (1-based) is empty (or '
+                    f'is whitespace); it must have a value. Line:\n{line}'
                 )
 
         yield row
 
+class _FallBack(Exception):
+    'Input which _parse_pandas leaves for _parse to handle'
+
+def _parse_pandas(f, dialect, column_count):
+    '''
+    Parse csv like _parse, but with pandas' C engine
+
+    Raises
+    ------
+    _FallBack
+        On input which _parse would handle differently or raise for.
+    '''
+    # Keep chunks at about 1M values
+    chunks = pd.read_csv(
+        f,
+        engine='c',
+        header=None,
+        dtype=str,
+        na_filter=False,
+        skip_blank_lines=True,
+        sep=dialect.delimiter,
+        quotechar=dialect.quotechar,
+        quoting=dialect.quoting,
+        doublequote=dialect.doublequote,
+        escapechar=dialect.escapechar,
+        skipinitialspace=dialect.skipinitialspace,
+        chunksize=max(1, 2**20 // column_count),
+    )
+    try:
+        for chunk in chunks:
+            # Rows with too few columns get NaN (or '') as missing values
+            if chunk.shape[1] != column_count or chunk.isna().values.any():
+                raise _FallBack('inconsistent column count or whitespace line')
+            values = chunk.apply(lambda column: column.str.strip()).values
+            if (values == '').any():
+                raise _FallBack('empty value')
+            yield from values.tolist()
+    except pd.errors.ParserError as ex:
+        raise _FallBack() from ex
+
 def _read_non_empty_lines(f):
-    for line_number, line in enumerate(f.readlines(), start=1):
+    for line_number, line in enumerate(f, start=1):
         if not line.strip():
             continue
         yield line_number, line.rstrip('\n')
@@ -21,7 +21,34 @@ other way around
 '''
 
 from contextlib import contextmanager
-import chardet
+from pathlib import Path
+import bz2
+import codecs
+import gzip
+import hashlib
+import io
+import logging
+import lzma
+import pickle
+import re
+import shutil
+import sys
+import tempfile
+import time
+
+from chardet.universaldetector import UniversalDetector
+import attr
+import humanize
+
+try:
+    import resource
+except ImportError:  # e.g. on Windows
+    resource = None
+
+try:
+    import zstandard
+except ImportError:  # optional
+    zstandard = None
 
 
 class UserError(Exception):
@@ -36,26 +63,319 @@ class UserError(Exception):
     '''
 
 @contextmanager
-def open_text(path):
+def open_text(path, sample_size=2**20):
     '''
     Robustly open text file
 
-    Autodetect encoding. Python's universal newlines takes care of
-    strange/mixed line endings.
+    Autodetect encoding and compression. Python's universal newlines takes
+    care of strange/mixed line endings.
+
+    gzip, bzip2, xz and zstd compressed files are decompressed as they are
+    read, detected by their magic bytes rather than by file extension. zstd
+    requires the optional ``zstandard`` package.
+
+    The encoding is derived from the byte order mark (BOM) if there is one,
+    else it is detected by chardet from just the first ``sample_size`` bytes,
+    stopping early once chardet is confident. If the sample is plain ASCII,
+    the rest of the file is assumed to be UTF-8 (a superset of ASCII). Where
+    the rest of the file turns out not to be in the detected encoding, reading
+    it raises a `UserError` suggesting ``sample_size=None``.
 
     Parameters
     ----------
     path : ~pathlib.Path
+    sample_size : int or None
+        Maximum number of bytes to detect the encoding from. If None, detect
+        it from the whole file, which is slow on large files but helps when
+        the first non-ASCII characters come late in a file which isn't UTF-8.
 
     Returns
     -------
     file
-        File object of the opened text file
+        File object of the opened text file. It's only seekable if the file is
+        not compressed or compressed with other than zstd.
     '''
+    with span('open_text', path=str(path)) as fields:
+        with _open_decompressed(path) as f:
+            sample = f.read() if sample_size is None else f.read(sample_size)
+        complete = sample_size is None or len(sample) < sample_size
+        encoding = _detect_encoding(sample, complete)
+        fields.update(sample_bytes=len(sample), encoding=encoding)
+
+    # Reopen rather than seek, not all decompressors can seek
+    with _open_decompressed(path) as f:
+        with io.TextIOWrapper(f, encoding=encoding) as text:
+            try:
+                yield text
+            except UnicodeDecodeError as ex:
+                if complete:
+                    raise
+                raise UserError(
+                    f'{path} is not {encoding} after all, which was detected '
+                    f'from its first {len(sample)} bytes: {ex}. Detect the '
+                    'encoding from the whole file instead with sample_size=None'
+                ) from ex
+
+def _open_zstd(f):
+    if zstandard is None:
+        raise UserError(
+            f'{f.name} is zstd compressed, reading it requires the zstandard '
+            'package to be installed'
+        )
+    # Buffered so that reads return as much as asked for
+    return io.BufferedReader(zstandard.ZstdDecompressor().stream_reader(f))
+
+# Magic bytes at the start of compressed files. bzip2's is followed by a
+# block size digit and the magic of either its first block or, if empty, of
+# the end of the stream
+_COMPRESSIONS = (
+    (re.compile(rb'\x1f\x8b'), lambda f: gzip.GzipFile(fileobj=f)),
+    (re.compile(rb'BZh[1-9](1AY&SY|\x17rE8P\x90)'), bz2.BZ2File),
+    (re.compile(rb'\xfd7zXZ\x00'), lzma.LZMAFile),
+    (re.compile(rb'\x28\xb5\x2f\xfd'), _open_zstd),
+)
+
+@contextmanager
+def _open_decompressed(path):
+    'Open a file in binary mode, decompressing it if it is compressed'
     with path.open('rb') as f:
-        encoding = chardet.detect(f.read())['encoding']
-    with path.open(encoding=encoding) as f:
+        magic = f.read(10)
+        f.seek(0)
+        for pattern, open_ in _COMPRESSIONS:
+            if pattern.match(magic):
+                with open_(f) as decompressed:
+                    yield decompressed
+                return
         yield f
 
+# UTF-32 before UTF-16 as the UTF-32 LE BOM starts with the UTF-16 LE BOM. The
+# utf-16/32 codecs skip the BOM and use the byte order it indicates.
+_BOMS = (
+    (codecs.BOM_UTF8, 'utf-8-sig'),
+    (codecs.BOM_UTF32_LE, 'utf-32'),
+    (codecs.BOM_UTF32_BE, 'utf-32'),
+    (codecs.BOM_UTF16_LE, 'utf-16'),
+    (codecs.BOM_UTF16_BE, 'utf-16'),
+)
+
+def _detect_encoding(sample, complete):
+    '''
+    Detect encoding of a sample of bytes
+
+    Parameters
+    ----------
+    sample : bytes
+        First bytes of a file.
+    complete : bool
+        Whether the sample is the whole file.
+
+    Returns
+    -------
+    str or None
+        Encoding, None if unknown, e.g. when the sample is empty.
+    '''
+    for bom, encoding in _BOMS:
+        if sample.startswith(bom):
+            return encoding
+
+    detector = UniversalDetector()
+    chunk_size = 2**16
+    for start in range(0, len(sample), chunk_size):
+        detector.feed(sample[start:start+chunk_size])
+        if detector.done:
+            break
+    detector.close()
+    encoding = detector.result['encoding']
+    if encoding == 'ascii' and not complete:
+        encoding = 'utf-8'
+    return encoding
+
+_span_logger = logging.getLogger('varbio.spans')
+
+@contextmanager
+def span(name, **fields):
+    '''
+    Measure a block of code and log it as a span, if spans are enabled
+
+    Spans are logged at debug level to the ``varbio.spans`` logger, with their
+    fields as the ``span`` attribute of the log record. `init_logging` enables
+    them on request; while disabled, a span costs next to nothing.
+
+    Parameters
+    ----------
+    name : str
+        What the block does, e.g. ``'parse_csv'``.
+    **fields
+        JSON serialisable details to log, e.g. the path of the file.
+
+    Yields
+    ------
+    dict
+        ``fields``, add to it to log details known only inside the block, e.g.
+        the number of rows processed. Set ``seconds`` to log that instead of
+        the wall time, e.g. when the block is a generator and only the time
+        spent producing items should count.
+
+    Notes
+    -----
+    Besides the fields, a span logs its wall time in seconds and the peak
+    resident set size (RSS) in bytes of the whole process so far, at the start
+    (``max_rss_start``) and at the end (``max_rss_end``) of the block, or None
+    if unknown. These are high-water marks of the process, not of the block: if
+    they are equal the block did not use more memory than the process already
+    had at some point, otherwise it raised the peak to ``max_rss_end``.
+    '''
+    if not _span_logger.isEnabledFor(logging.DEBUG):
+        yield fields
+        return
+    max_rss_start = _get_peak_rss()
+    start = time.perf_counter()
+    try:
+        yield fields
+    finally:
+        seconds = fields.pop('seconds', time.perf_counter() - start)
+        record = dict(
+            fields, span=name, seconds=seconds,
+            max_rss_start=max_rss_start, max_rss_end=_get_peak_rss(),
+        )
+        details = ', '.join(f'{key}={value!r}' for key, value in fields.items())
+        if max_rss_start is None:
+            max_rss = 'unknown'
+        else:
+            max_rss = '{} -> {}'.format(*(
+                humanize.naturalsize(record[key], binary=True)
+                for key in ('max_rss_start', 'max_rss_end')
+            ))
+        _span_logger.debug(
+            f'{name} took {record["seconds"]:.3f}s, process peak RSS {max_rss}: '
+            f'{details}',
+            extra={'span': record}
+        )
+
+def _get_peak_rss():
+    if resource is None:
+        return None
+    peak_rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # Bytes on macOS, KiB elsewhere
+    return peak_rss if sys.platform == 'darwin' else peak_rss * 1024
+
 def join_lines(text):
     return ' '.join(map(str.strip, text.splitlines())).strip()
+
+@contextmanager
+def replace_directory(path):
+    '''
+    Write a directory as a whole, replacing it if it exists
+
+    Yields a temporary directory next to ``path`` to write to instead, which
+    is moved in place once the block completes. So an interrupted write leaves
+    ``path`` as it was and files of a previous version are unlinked rather
+    than overwritten, which would corrupt them for anyone memory mapping them.
+    There is a brief moment where ``path`` does not exist.
+    '''
+    path.parent.mkdir(parents=True, exist_ok=True)
+    temporary = Path(tempfile.mkdtemp(dir=str(path.parent), prefix='.tmp'))
+    try:
+        yield temporary
+        if path.exists():
+            old = temporary.with_name(temporary.name + '.old')
+            path.rename(old)
+            temporary.rename(path)
+            shutil.rmtree(str(old))
+        else:
+            temporary.rename(path)
+    finally:
+        if temporary.exists():
+            shutil.rmtree(str(temporary))
+
+@attr.s(slots=True, frozen=True)
+class ParseCache:
+
+    '''
+    On-disk cache of parse results, keyed by file content
+
+    Pass it as ``cache`` to e.g. `parse_csv` to have it return the result of
+    an earlier parse of a file with the same content, varbio version and parse
+    options, without detecting the encoding or parsing again. A hit costs a
+    hash of the file and loading the cached result.
+
+    Entries are never evicted, delete the directory to clear the cache. Only
+    use cache directories you trust as entries are unpickled.
+
+    Parameters
+    ----------
+    directory : ~pathlib.Path
+        Directory to store entries in, created if it does not exist.
+    '''
+
+    directory = attr.ib()
+    '~pathlib.Path'
+
+    def get(self, path, kind, version, options, parse):
+        '''
+        Get parse result of file from cache, or parse and cache it
+
+        Parameters
+        ----------
+        path : ~pathlib.Path
+            File to parse.
+        kind : str
+            Name of the parse function.
+        version : str
+            Version of the parse function, i.e. of varbio, part of the key.
+        options : dict
+            Options passed to the parse function, part of the key.
+        parse : ~typing.Callable[[], ~typing.Any]
+            Parse the file, result must be picklable.
+        '''
+        def write(entry):
+            with (entry / 'result.pickle').open('wb') as f:
+                pickle.dump(parse(), f, pickle.HIGHEST_PROTOCOL)
+        entry = self.get_entry(path, kind, version, options, write)
+        with (entry / 'result.pickle').open('rb') as f:
+            return pickle.load(f)
+
+    def get_entry(self, path, kind, version, options, write):
+        '''
+        Get directory of cache entry of file, write it if missing
+
+        Parameters
+        ----------
+        path, kind, version, options
+            See `get`.
+        write : ~typing.Callable[[~pathlib.Path], None]
+            Write the entry to the given empty directory.
+
+        Returns
+        -------
+        ~pathlib.Path
+            Directory of the entry. Don't modify it.
+        '''
+        entry = self.directory / self._key(path, kind, version, options)
+        if entry.exists():
+            return entry
+
+        # Write to a temporary directory and move it in place when complete, so
+        # that interrupted or concurrent writes never leave a corrupt entry
+        self.directory.mkdir(parents=True, exist_ok=True)
+        temporary = Path(tempfile.mkdtemp(dir=str(self.directory), prefix='.tmp'))
+        try:
+            write(temporary)
+            temporary.rename(entry)
+        except OSError:
+            if not entry.exists():
+                raise
+            # Concurrently created by someone else
+        finally:
+            if temporary.exists():
+                shutil.rmtree(str(temporary))
+        return entry
+
+    def _key(self, path, kind, version, options):
+        hash_ = hashlib.sha256()
+        with path.open('rb') as f:
+            for chunk in iter(lambda: f.read(2**20), b''):
+                hash_.update(chunk)
+        options = sorted((key, repr(value)) for key, value in options.items())
+        hash_.update(repr((version, kind, options)).encode())
+        return hash_.hexdigest()
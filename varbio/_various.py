@@ -15,19 +15,27 @@
 # You should have received a copy of the GNU Lesser General Public License
 # along with varbio.  If not, see <http://www.gnu.org/licenses/>.
 
+from collections import deque
+from concurrent.futures import ProcessPoolExecutor, ThreadPoolExecutor
+from itertools import chain, compress, islice
 from numbers import Number
 from textwrap import dedent
+import json
 import logging
+import math
+import os
 import re
 
 import attr
 import humanize
 import numpy as np
 import pandas as pd
+import scipy.stats
 import yaml
 
 from varbio import __version__
-from varbio._util import open_text, UserError, join_lines
+from varbio._csv import parse_csv
+from varbio._util import open_text, UserError, join_lines, span, replace_directory
 
 
 @attr.s(slots=True, repr=False, frozen=True)
@@ -43,7 +51,8 @@ class ExpressionMatrix:
         Unique name of the matrix.
     data : ~pandas.DataFrame
         Gene expression data. The data frame is a matrix of gene expression of
-        type `float` with genes as index of type `str`.
+        type `float` (float64, or float32 to save memory) with genes as index
+        of type `str`.
     '''
 
     name = attr.ib()
@@ -72,6 +81,9 @@ class ExpressionMatrix:
         '''
     )
 
+    # Version of the format of save
+    _format_version = 1
+
     def __repr__(self):
         return f'ExpressionMatrix({self.name!r})'
 
@@ -92,6 +104,10 @@ class ExpressionMatrix:
         self._raise_if_duplicates(data.columns, 'column')
 
     def _raise_if_duplicates(self, index, index_name):
+        # pandas caches is_unique on the index, so this is O(1) for data
+        # sharing its index with an already validated matrix
+        if index.is_unique:
+            return
         duplicates = index[index.duplicated()]
         if not duplicates.empty:
             duplicates = ', '.join(map(repr, duplicates))
@@ -100,7 +116,21 @@ class ExpressionMatrix:
             )
 
     @classmethod
-    def from_dict(cls, matrix):
+    def from_dict(cls, matrix, type_check_limit=None, dtype=float):
+        '''
+        Construct from a dict, e.g. parsed with parse_yaml
+
+        Parameters
+        ----------
+        matrix : dict
+            Dict with a name and data, see the example in the error messages.
+        type_check_limit : int or None
+            If not None, only warn about values which aren't of a number type
+            among the first ``type_check_limit`` values, which is faster than
+            checking all of them.
+        dtype
+            Float dtype of the values, e.g. ``np.float32`` to halve memory use.
+        '''
         # Usually from_dict is called as part of parse_yaml so error messages
         # somewhat assume the input is actually yaml
         def _raise(msg):
@@ -142,30 +172,55 @@ class ExpressionMatrix:
                     .format(humanize.ordinal(i), difference, row)
                 )
 
-        # dtype=object to preserve the type, else the whole lot can become str
-        # for example
-        data = np.array(data, dtype=object)
-        cls._warn_if_unexpected_type(data)
+        # Check the types on the original values, converting to e.g. an object
+        # or str array would lose them
+        header = data[0]
+        rows = [row[0] for row in data[1:]]
+        values = [row[1:] for row in data[1:]]
+        cls._warn_if_unexpected_type(header[1:], rows, values, type_check_limit)
 
-        return cls._from_array(matrix['name'], data)
+        # numpy converts the nested lists in one go
+        return cls._from_values(matrix['name'], header, rows, values, dtype)
 
     @classmethod
-    def _warn_if_unexpected_type(cls, data):
-        columns = data[0, 1:]
-        rows = data[1:, 0]
-        values = data[1:, 1:]
+    def _warn_if_unexpected_type(cls, columns, rows, values, limit=None):
+        '''
+        Warn about odd types of the names and values of the matrix
+
+        Types are checked per distinct type rather than per value, with
+        builtins only, so the loops over all values run at C speed.
+
+        Parameters
+        ----------
+        columns : ~typing.Iterable
+        rows : ~typing.Iterable
+        values : ~typing.Iterable[~typing.Iterable]
+            Rows of values.
+        limit : int or None
+            Check only the first ``limit`` values.
+        '''
+        def iter_values():
+            values_ = chain.from_iterable(values)
+            return values_ if limit is None else islice(values_, limit)
+
+        def non_number_types(items):
+            return {
+                type_ for type_ in set(map(type, items))
+                if not issubclass(type_, Number)
+            }
+
         should_warn = False
 
         # Warn if all row or column names are numbers. This guards against an input
         # like [[1, 2], [3, 4]]; i.e. user forgot to add a header or row names.
-        if all(isinstance(row, Number) for row in rows):
+        if not non_number_types(rows):
             should_warn = True
             logging.warning(
                 'All row names are numbers, perhaps you forgot to add the row '
                 'names? If this is intended, consider wrapping them in '
                 'quotes (\'") to avoid this warning.'
             )
-        if all(isinstance(column, Number) for column in columns):
+        if not non_number_types(columns):
             should_warn = True
             logging.warning(
                 'All column names are numbers, perhaps you forgot to add the header row? '
@@ -175,17 +230,20 @@ class ExpressionMatrix:
 
         # We also warn for values as this is also not something you'd tend to
         # normally do
-        odd_values = [value for value in values.ravel() if not isinstance(value, Number)]
-        if odd_values:
+        odd_types = non_number_types(iter_values())
+        if odd_types:
             should_warn = True
-            odd_count = len(odd_values)
-            odd_values = list(map(repr, odd_values[:10]))
+            def odd_mask():
+                return map(odd_types.__contains__, map(type, iter_values()))
+            odd_count = sum(odd_mask())
+            odd_values = list(map(repr, islice(compress(iter_values(), odd_mask()), 10)))
             if odd_count > 10:
                 odd_values.append('...')
             odd_values = ', '.join(odd_values)
+            checked = 'values' if limit is None else f'of the first {limit} values'
             logging.warning(join_lines(
                 f'''
-                {odd_count} values are not of a number type, it is preferred to
+                {odd_count} {checked} are not of a number type, it is preferred to
                 specify these as number literals (e.g. 3, .inf, -.inf, .nan)
                 instead of e.g. strings. Given non-number values: {odd_values}
                 '''
@@ -195,84 +253,535 @@ class ExpressionMatrix:
             logging.warning(f'\n{cls._matrix_example_msg}')
 
     @classmethod
-    def from_csv(cls, name, data):
-        'Construct from data parsed with parse_csv'
-        data = np.array(list(data), dtype=object)
-        return cls._from_array(name, data)
+    def _trusted(cls, name, data):
+        '''
+        Construct without validation
+
+        Only for a name and data derived from an already validated matrix in a
+        way which can't introduce duplicate names, e.g. a subset of its rows.
+        '''
+        matrix = object.__new__(cls)
+        object.__setattr__(matrix, 'name', name)
+        object.__setattr__(matrix, 'data', data)
+        return matrix
+
+    def subset(self, rows=None, columns=None):
+        '''
+        Get a matrix with a subset of the rows and/or columns
+
+        Parameters
+        ----------
+        rows : ~typing.Iterable[str] or None
+            Names of the rows to keep, or None to keep all. Names not in the
+            matrix are ignored.
+        columns : ~typing.Iterable[str] or None
+            Names of the columns to keep, or None to keep all. Likewise.
+
+        Returns
+        -------
+        ExpressionMatrix
+            With the same name, rows and columns in the same order as in this
+            matrix.
+        '''
+        data = self.data
+        if rows is not None:
+            data = data[data.index.isin(list(rows))]
+        if columns is not None:
+            data = data.loc[:, data.columns.isin(list(columns))]
+        return self._trusted(self.name, data)
+
+    def astype(self, dtype):
+        '''
+        Get a matrix with its values converted to a float dtype
+
+        Parameters
+        ----------
+        dtype
+            E.g. ``np.float32`` to halve memory use.
+
+        Returns
+        -------
+        ExpressionMatrix
+        '''
+        return self._trusted(self.name, self.data.astype(dtype))
+
+    def get_bait_positions(self, baits):
+        '''
+        Get the row positions of baits, e.g. as returned by `parse_baits`
+
+        Parameters
+        ----------
+        baits : ~typing.Iterable[str]
+            Names of rows.
+
+        Returns
+        -------
+        ArrayLike[int]
+            Position of each bait in `data`, in the same order. Pass these to
+            `pearson` as ``indices``.
+
+        Raises
+        ------
+        UserError
+            Listing all baits which are not in the matrix.
+        '''
+        try:
+            return _get_positions(self.data.index, pd.Index(baits), self.name)
+        except KeyError as ex:
+            raise UserError(ex.args[0]) from None
+
+    def pearson(self, baits, **kwargs):
+        '''
+        Get Pearson's r of each row compared to the baits
+
+        Like ``pearson_df(matrix.data, matrix.data.loc[baits])``, without
+        copying the rows of the baits into a data frame first.
+
+        Parameters
+        ----------
+        baits : ~typing.Iterable[str]
+            Names of the rows to compare against.
+        **kwargs
+            Passed to `pearson`, e.g. ``n_jobs``.
+
+        Returns
+        -------
+        correlation_matrix : pandas.DataFrame[float]
+            Data frame with the rows of `data` as index and ``baits`` as
+            columns.
+
+        Raises
+        ------
+        UserError
+            Listing all baits which are not in the matrix.
+        '''
+        baits = pd.Index(baits)
+        correlations = pearson(self.data.values, self.get_bait_positions(baits), **kwargs)
+        return pd.DataFrame(
+            correlations, index=self.data.index, columns=baits, copy=False
+        )
+
+    def pearson_all_edges(self, threshold=None, top_k=None, absolute=False,
+                          n_jobs=1, dtype=None):
+        '''
+        Get the strongest Pearson's r of all pairs of rows
+
+        See `pearson_all_edges`.
+
+        Returns
+        -------
+        edges : pandas.DataFrame
+            Data frame with a row per correlation kept and columns: ``gene1``
+            and ``gene2``, the names of the pair of rows, with ``gene1``
+            before ``gene2`` in the matrix; and ``r``, their correlation.
+        '''
+        rows, columns, correlations = pearson_all_edges(
+            self.data.values, threshold=threshold, top_k=top_k,
+            absolute=absolute, n_jobs=n_jobs, dtype=dtype
+        )
+        return pd.DataFrame({
+            'gene1': self.data.index[rows],
+            'gene2': self.data.index[columns],
+            'r': correlations,
+        })
+
+    def prepare_correlation(self, dtype=None):
+        '''
+        Prepare for fast repeated correlation queries against this matrix
+
+        Parameters
+        ----------
+        dtype
+            dtype of the standardised matrix, e.g. ``np.float32`` to halve its
+            memory. None to follow the dtype of `data`, see `pearson`.
+
+        Returns
+        -------
+        StandardisedMatrix
+        '''
+        return StandardisedMatrix.from_df(self.name, self.data, dtype)
+
+    def save(self, path):
+        '''
+        Save in a binary format which `load` can memory map
+
+        The matrix is saved as a directory with the values as a C-order
+        ``values.npy`` and the name, row and column names as ``meta.json``.
+
+        Parameters
+        ----------
+        path : ~pathlib.Path
+            Directory to save to. If it exists, it is replaced as a whole, so
+            matrices memory mapped from it remain valid.
+        '''
+        meta = {
+            'format_version': self._format_version,
+            'varbio_version': __version__,
+            'name': self.name,
+            'index_name': self.data.index.name,
+            'index': self.data.index.tolist(),
+            'columns': self.data.columns.tolist(),
+        }
+        with replace_directory(path) as temporary:
+            np.save(temporary / 'values.npy', np.ascontiguousarray(self.data.values))
+            (temporary / 'meta.json').write_text(json.dumps(meta))
+
+    @classmethod
+    def load(cls, path, mmap=True):
+        '''
+        Load a matrix saved with `save`
+
+        Parameters
+        ----------
+        path : ~pathlib.Path
+            Directory the matrix was saved to.
+        mmap : bool
+            If True, memory map the values read-only instead of reading them
+            into memory. Loading is then nearly instant and processes which
+            load the same matrix share its pages in the OS page cache.
+
+        Returns
+        -------
+        ExpressionMatrix
+        '''
+        meta = json.loads((path / 'meta.json').read_text())
+        if meta['format_version'] != cls._format_version:
+            raise ValueError(
+                f'{path} has format version {meta["format_version"]}, varbio '
+                f'{__version__} only supports version {cls._format_version}'
+            )
+        values = np.load(path / 'values.npy', mmap_mode='r' if mmap else None)
+        data = pd.DataFrame(
+            values,
+            index=pd.Index(meta['index'], name=meta['index_name']),
+            columns=pd.Index(meta['columns']),
+            copy=False,
+        )
+        # It was validated before it was saved
+        return cls._trusted(meta['name'], data)
 
     @classmethod
-    def _from_array(cls, name, data):
-        # Convert values to the correct type and create a df from them
-        columns = data[0, 1:]
-        rows = data[1:, 0]
-        values = data[1:, 1:]
-        index = pd.Index(rows.astype(str), name=str(data[0, 0]))
-        columns = columns.astype(str)
+    def from_csv(cls, name, data, dtype=float):
+        '''
+        Construct from data parsed with parse_csv
+
+        Values are converted to float row by row as they are read, straight
+        into a float buffer, so data can be a generator and is never held in
+        memory as str objects all at once.
+
+        Parameters
+        ----------
+        name : str
+        data : ~typing.Iterable[~typing.List[str]]
+            Rows, header first.
+        dtype
+            Float dtype of the values, e.g. ``np.float32`` to halve memory use.
+        '''
+        rows = iter(data)
         try:
-            df = pd.DataFrame(values, index=index, columns=columns, dtype=float)
-        except ValueError as ex:
-            if 'convert string to float' in str(ex):
-                msg = f'Invalid float value: {ex.__cause__.args[0]}'
-                raise UserError(msg) from ex
+            header = next(rows)
+        except StopIteration:
+            raise ValueError('data must contain at least a header row') from None
+
+        # When data is parse_csv's generator, parsing happens inside this span
+        # as well. parse_csv's own span only counts the parsing, so conversion
+        # took the difference.
+        index = []
+        values = np.empty((1024, len(header) - 1), dtype=dtype)
+        with span('ExpressionMatrix.from_csv', name=name) as fields:
+            for i, row in enumerate(rows):
+                if i == len(values):
+                    values.resize((2 * len(values), values.shape[1]), refcheck=False)
+                index.append(str(row[0]))
+                try:
+                    values[i] = row[1:]
+                except ValueError as ex:
+                    if 'convert string to float' in str(ex):
+                        raise UserError(f'Invalid float value: {ex.args[0]}') from ex
+                    raise
+            values.resize((len(index), values.shape[1]), refcheck=False)
+            fields['shape'] = values.shape
+        return cls._from_values(name, header, index, values, dtype)
+
+    @classmethod
+    def _from_values(cls, name, header, rows, values, dtype=float):
+        '''
+        Construct from the parts of a data matrix
+
+        Parameters
+        ----------
+        name : str
+        header : ~typing.Sequence
+            Index name followed by the column names.
+        rows : ~typing.Sequence
+            Row names.
+        values : ArrayLike
+            Values of each row, converted to ``dtype``.
+        dtype
+        '''
+        with span('ExpressionMatrix._from_values', name=name) as fields:
+            try:
+                values = np.asarray(values, dtype=dtype)
+            except (ValueError, TypeError) as ex:
+                raise UserError(f'Invalid float value: {ex}') from ex
+            df = pd.DataFrame(
+                values.reshape(len(rows), len(header) - 1),
+                index=pd.Index(list(map(str, rows)), name=str(header[0])),
+                columns=pd.Index(list(map(str, header[1:]))),
+                copy=False,
+            )
+            fields['shape'] = df.shape
+            return cls._from_df(name, df)
+
+    @classmethod
+    def read_csv(cls, name, path, cache=None, mmap=True, dtype=float, **kwargs):
+        '''
+        Construct from a csv file
+
+        Parameters
+        ----------
+        name : str
+            Name of the matrix.
+        path : ~pathlib.Path
+            File to parse with `parse_csv`.
+        cache : ParseCache or None
+            If not None, get the matrix from this cache, in the format of
+            `save`. It is only parsed on a miss.
+        mmap : bool
+            Whether to memory map a matrix from the cache, see `load`.
+        dtype
+            Float dtype of the values, see `from_csv`.
+        **kwargs
+            Options to `parse_csv`, e.g. ``sample_size=None`` to detect the
+            encoding from the whole file.
+
+        Returns
+        -------
+        ExpressionMatrix
+        '''
+        if cache is None:
+            return cls.from_csv(name, parse_csv(path, **kwargs), dtype)
+        return cls.load(cls._get_csv_entry(name, path, cache, dtype, kwargs), mmap=mmap)
+
+    @classmethod
+    def _get_csv_entry(cls, name, path, cache, dtype, kwargs):
+        'Get the cache entry of `read_csv`, reading the file on a miss'
+        def write(entry):
+            cls.from_csv(name, parse_csv(path, **kwargs), dtype).save(entry)
+        options = dict(kwargs, name=name, dtype=np.dtype(dtype).name)
+        options.pop('engine', None)  # doesn't affect the result
+        return cache.get_entry(
+            path, 'ExpressionMatrix.read_csv', __version__, options, write
+        )
+
+    @classmethod
+    def read_csvs(cls, paths, directory=None, cache=None, n_jobs=-1, mmap=True,
+                  dtype=float, **kwargs):
+        '''
+        Construct from many csv files, in parallel
+
+        Each file is read with `read_csv` in a separate process, as parsing
+        holds the GIL. Workers save each matrix in the format of `save` and
+        this process then loads them, memory mapped, so values are never
+        pickled between processes.
+
+        Parameters
+        ----------
+        paths : ~typing.Mapping[str, ~pathlib.Path]
+            Matrix name to csv file to read it from, for each matrix.
+        directory : ~pathlib.Path or None
+            Directory to save the matrices to, created if it does not exist.
+            The matrices are memory mapped from there, so keep the directory
+            until the matrices are no longer used. Required without ``cache``.
+        cache : ParseCache or None
+            If not None, save to and load from this cache instead of
+            ``directory``, see `read_csv`.
+        n_jobs : int
+            Number of processes to read with, ``-1`` for 1 per CPU. If 1, files
+            are read in this process instead.
+        mmap, dtype, **kwargs
+            See `read_csv`.
+
+        Returns
+        -------
+        ~typing.Dict[str, ExpressionMatrix]
+            Matrix name to matrix, in the order of ``paths``.
+
+        Raises
+        ------
+        UserError
+            After all files are read, if any of them could not be read, with
+            the `UserError` message of each file which couldn't.
+        '''
+        if directory is None and cache is None:
+            raise ValueError('Either directory or cache must be given')
+        n_jobs = min(_resolve_n_jobs(n_jobs), max(1, len(paths)))
+        names = list(paths)
+        entries = [
+            None if cache is not None else directory / str(i)
+            for i in range(len(names))
+        ]
+        arguments = (
+            names, [paths[name] for name in names], entries,
+            [cache] * len(names), [dtype] * len(names), [kwargs] * len(names)
+        )
+        if n_jobs == 1:
+            results = list(map(_read_csv_to_disk, *arguments))
+        else:
+            with ProcessPoolExecutor(n_jobs) as executor:
+                results = list(executor.map(_read_csv_to_disk, *arguments))
+        errors, entries = zip(*results) if results else ((), ())
+
+        errors = [
+            f'{paths[name]}: {error}'
+            for name, error in zip(names, errors)
+            if error is not None
+        ]
+        if errors:
+            raise UserError('Failed to read matrices:\n\n' + '\n\n'.join(errors))
+
+        return {
+            name: cls.load(entry, mmap=mmap)
+            for name, entry in zip(names, entries)
+        }
+
+    @classmethod
+    def _from_df(cls, name, df):
         try:
             return cls(name=name, data=df)
         except ValueError as ex:
             raise UserError(ex.args[0]) from ex
 
-def parse_yaml(path):
+def _read_csv_to_disk(name, path, entry, cache, dtype, kwargs):
+    '''
+    Read a matrix in a worker of `ExpressionMatrix.read_csvs`
+
+    Save it to entry, or to the cache if entry is None.
+
+    Returns
+    -------
+    error : str or None
+        The `UserError` message if the file could not be read.
+    entry : ~pathlib.Path or None
+        Directory the matrix got saved to, None on error.
+    '''
+    # pylint: disable=protected-access
+    try:
+        if entry is None:
+            entry = ExpressionMatrix._get_csv_entry(name, path, cache, dtype, kwargs)
+        else:
+            ExpressionMatrix.read_csv(name, path, dtype=dtype, **kwargs).save(entry)
+        return None, entry
+    except UserError as ex:
+        return str(ex), None
+
+def parse_yaml(path, fast=False, cache=None, sample_size=2**20):
     '''
     Robustly parse yaml
 
     Parameters
     ----------
     path : ~pathlib.Path
+    fast : bool
+        If True, parse with libyaml (`yaml.CSafeLoader`), which is much faster
+        on large files. Falls back to the pure python loader if PyYAML was
+        built without libyaml.
+    cache : ParseCache or None
+        If not None, get the result from this cache, parsing only on a miss.
+    sample_size : int or None
+        Maximum number of bytes to detect the encoding from, see `open_text`.
 
     Returns
     -------
     dict or list
         Parsed YAML as returned by `yaml.load`.
     '''
-    with open_text(path) as f:
-        # C loaders are faster than regular loaders but require libyaml,
-        # performance is not an issue in our case so we rather ditch the
-        # dependency. SafeLoader disables insecure features which we don't need,
-        # e.g. arbitrary code execution if I recall correctly; more generally it
-        # reduces the attack surface from parsing untrusted inputs.
+    # C loaders are faster than regular loaders but require libyaml, so they
+    # are opt-in and optional. SafeLoader disables insecure features which we
+    # don't need, e.g. arbitrary code execution if I recall correctly; more
+    # generally it reduces the attack surface from parsing untrusted inputs.
+    if cache is not None:
+        return cache.get(
+            path, 'parse_yaml', __version__, {'sample_size': sample_size},
+            lambda: parse_yaml(path, fast, sample_size=sample_size)
+        )
+
+    loader = yaml.SafeLoader
+    if fast:
+        loader = getattr(yaml, 'CSafeLoader', yaml.SafeLoader)
+    with open_text(path, sample_size) as f:
         try:
-            return yaml.load(f, yaml.SafeLoader)
+            return yaml.load(f, loader)
         except yaml.YAMLError as ex:
             raise UserError(f'YAML file contains error: {ex}') from ex
 
-def parse_baits(path, min_baits):
+def parse_baits(path, min_baits, cache=None, sample_size=2**20):
     '''
     Robustly parse baits file
 
     Parameters
     ----------
     path : ~pathlib.Path
+    min_baits : int
+        Minimum number of baits the file must contain.
+    cache : ParseCache or None
+        If not None, get the baits from this cache, parsing only on a miss.
+    sample_size : int or None
+        Maximum number of bytes to detect the encoding from, see `open_text`.
 
     Returns
     -------
     list
-        Bait names
-    '''
-    with open_text(path) as f:
-        # Doesn't work for gene names which contain spaces, would have to use yaml
-        # input for that
-        baits = [
-            bait
-            for bait in re.split(r'[\s,;]+', f.read())
-            if bait
-        ]
+        Bait names, without duplicates, in order of first occurrence.
 
-        if len(baits) < min_baits:
-            raise UserError(
-                f'{path} needs at least {min_baits} baits, but contains only {len(baits)}'
-            )
+    Notes
+    -----
+    The file is read in chunks of ``2**16`` characters, so besides the baits
+    only a chunk is held in memory at a time.
+    '''
+    if cache is None:
+        baits = _read_baits(path, sample_size)
+    else:
+        baits = cache.get(
+            path, 'parse_baits', __version__, {'sample_size': sample_size},
+            lambda: _read_baits(path, sample_size)
+        )
+
+    if len(baits) < min_baits:
+        raise UserError(
+            f'{path} needs at least {min_baits} baits, but contains only {len(baits)}'
+        )
+
+    return baits
+
+# Doesn't work for gene names which contain spaces, would have to use yaml
+# input for that
+_BAIT_SEPARATOR = re.compile(r'[\s,;]+')
 
-        return baits
+def _read_baits(path, sample_size, chunk_size=2**16):
+    with open_text(path, sample_size) as f:
+        # A dict keeps insertion order, dropping duplicates as they come
+        return list(dict.fromkeys(_tokenize_baits(f, chunk_size)))
 
-def pearson(data, indices):
+def _tokenize_baits(f, chunk_size):
+    # The last token of a chunk may continue in the next chunk, so it's only
+    # yielded once followed by a separator or the end of the file
+    remainder = ''
+    for chunk in iter(lambda: f.read(chunk_size), ''):
+        tokens = _BAIT_SEPARATOR.split(remainder + chunk)
+        remainder = tokens.pop()
+        yield from filter(None, tokens)
+    if remainder:
+        yield remainder
+
+# Rows/columns per tile of the correlation matrix. Large enough for BLAS to
+# reach peak throughput. Operands of a tile don't fit in cache, BLAS blocks for
+# cache itself; tiles bound the size of temporaries instead, e.g. a tile of
+# float64 correlations takes 32 MiB.
+_TILE_SIZE = 2048
+
+def pearson(data, indices, algorithm='gemm', n_jobs=1, dtype=None,
+            missing=None, min_overlap=2, out=None, max_memory=None):
     '''
     Get Pearson's r of each row in a 2D array compared to a subset thereof.
 
@@ -283,97 +792,1627 @@ def pearson(data, indices):
     indices
         Indices to derive the subset ``data[indices]`` to compare against. You
         may use any form of numpy indexing.
+    algorithm : str
+        ``'gemm'`` to standardise the rows once and get correlations from a
+        matrix multiply, one genes × baits tile at a time. ``'streaming'`` for
+        the vectorised form of ``gsl_stats_correlation``, see notes.
+    n_jobs : int
+        Number of threads to correlate blocks of rows on, ``-1`` for 1 per
+        CPU. Only supported by ``'gemm'``.
+    dtype
+        ``np.float32`` or ``np.float64``: dtype of the correlation matrix and
+        of the matrix multiplies. None to use float32 if ``data`` is float32,
+        else float64.
+    missing : str or None
+        None if ``data`` has no missing values. ``'pairwise'`` to treat NaN as
+        missing and correlate each pair of rows on the columns where both have
+        a value, i.e. pairwise-complete correlations. Only supported by
+        ``'gemm'``.
+    min_overlap : int
+        With ``missing='pairwise'``, the correlation of a pair of rows with
+        fewer than ``min_overlap`` columns in common is NaN.
+    out : ArrayLike[float] or None
+        Array of shape ``(len(data), len(indices))`` to write the correlations
+        to instead of a new array, e.g. a `numpy.memmap` to write them to disk.
+        If ``dtype`` is None, ``out.dtype`` is used. Only supported by
+        ``'gemm'``.
+    max_memory : int or None
+        If not None, limit the number of rows correlated at a time to keep
+        memory use below about ``max_memory`` bytes, not counting ``data`` and
+        ``out``. Without ``out``, the returned correlation matrix does count,
+        raising `ValueError` if it alone doesn't fit. Only supported by
+        ``'gemm'``.
 
     Returns
     -------
     correlation_matrix : ArrayLike[float]
         2D array containing all correlations. ``correlation_matrix[i,j]``
         contains ``correlation_function(data[i], data[indices][j]``. Its shape
-        is ``(len(data), len(indices))``.
+        is ``(len(data), len(indices))``. This is ``out`` if given.
 
     Notes
     -----
-    The current implementation is a vectorised form of ``gsl_stats_correlation``
-    from the GNU Scientific Library. Unlike GSL's implementation,
-    correlations are clipped to ``[-1, 1]``.
+    The ``'streaming'`` algorithm is a vectorised form of
+    ``gsl_stats_correlation`` from the GNU Scientific Library. It loops over
+    the columns in Python, so it is much slower than ``'gemm'`` on large
+    matrices. Both algorithms typically agree to within ``1e-12`` (absolute)
+    on float64 data. Unlike GSL's implementation, correlations are clipped to
+    ``[-1, 1]``. Rows with zero variance get NaN correlations.
+
+    With float32, rows are still centred and scaled in float64, only the
+    matrix multiply runs in float32, at twice the speed. Correlations then
+    typically differ from the float64 ones by less than ``1e-6``; the error
+    grows with the number of columns, up to about ``data.shape[1] * 6e-8``.
+
+    To correlate a matrix larger than memory, memory map it, e.g. with
+    `ExpressionMatrix.load`, and pass a `numpy.memmap` (e.g. from
+    `numpy.lib.format.open_memmap`) as ``out`` along with ``max_memory``. Rows
+    are then read from and correlations written to disk one block at a time.
+    The OS keeps pages of memory mapped files in its page cache, it counts
+    those towards the process' resident memory but can evict them at will.
+
+    numpy releases the GIL during the matrix multiplies, so ``n_jobs`` threads
+    run truly in parallel. Each ``matmul`` may however also use multiple threads
+    when numpy uses a multi-threaded BLAS; to avoid oversubscribing the CPUs,
+    limit BLAS to 1 thread (e.g. ``OMP_NUM_THREADS=1``) when using ``n_jobs``.
+
+    With ``missing='pairwise'``, the sums needed for each pair's r (counts,
+    sums, sums of squares and cross products over the shared columns) are
+    themselves matrix multiplies of the data and of its mask of present
+    values. This takes 6 matrix multiplies instead of 1, always in float64 as
+    the sums are prone to cancellation. Rows are centred on the mean of their
+    values beforehand to keep the cancellation error small.
 
     Pearson's r is also, perhaps more commonly, known as the product-moment
     correlation coefficient.
     '''
-    # Taking pearson of NaN, inf, -inf values is not supported
-    assert np.isfinite(data).all()
+    if algorithm not in ('gemm', 'streaming'):
+        raise ValueError(f'Unknown algorithm: {algorithm!r}')
+    n_jobs = _resolve_n_jobs(n_jobs)
+    if algorithm == 'streaming' and n_jobs != 1:
+        raise ValueError('n_jobs is only supported by the gemm algorithm')
+    _validate_missing(missing)
+    if algorithm == 'streaming':
+        unsupported = {'missing': missing, 'out': out, 'max_memory': max_memory}
+        for name, value in unsupported.items():
+            if value is not None:
+                raise ValueError(f'{name} is only supported by the gemm algorithm')
+
+    fields = dict(
+        shape=data.shape, baits=len(indices), algorithm=algorithm,
+        n_jobs=n_jobs, missing=missing
+    )
+    with span('pearson', **fields):
+        if algorithm == 'streaming':
+            dtype = _resolve_dtype(data, dtype)
+            # pylint: disable=len-as-condition
+            if not data.size or not len(indices):
+                return np.empty((data.shape[0], len(indices)), dtype=dtype)
+            return _pearson_streaming(data, indices).astype(dtype, copy=False)
+
+        return _correlation_matrix(
+            data, indices, 'pearson', n_jobs, dtype, missing, min_overlap, out,
+            max_memory
+        )
+
+def pearson_batch(data, index_sets, n_jobs=1, dtype=None, missing=None,
+                  min_overlap=2):
+    '''
+    Get Pearson's r like `pearson`, for each of many subsets at once.
+
+    Correlations against the union of the subsets are computed in one call to
+    `pearson` and then sliced for each subset, so ``data`` is only passed over
+    once instead of once per subset. This is much faster when the subsets
+    overlap or are small.
+
+    Parameters
+    ----------
+    data : ArrayLike[float]
+        2D array for which to calculate correlations between rows.
+    index_sets : ~typing.Iterable
+        Indices of each subset to compare against, see ``indices`` of
+        `pearson`.
+    n_jobs, dtype, missing, min_overlap
+        See `pearson`.
+
+    Yields
+    ------
+    correlation_matrix : ArrayLike[float]
+        Same as ``pearson(data, indices)``, for each ``indices`` in
+        ``index_sets`` in order. The correlation matrix of the union is kept in
+        memory until the last one is yielded.
+    '''
+    # Normalise any form of numpy indexing to positions
+    all_positions = np.arange(data.shape[0])
+    position_sets = [np.atleast_1d(all_positions[indices]) for indices in index_sets]
+    if position_sets:
+        union = np.unique(np.concatenate(position_sets))
+    else:
+        union = all_positions[:0]
+    correlations = pearson(
+        data, union, n_jobs=n_jobs, dtype=dtype, missing=missing,
+        min_overlap=min_overlap
+    )
+    for positions in position_sets:
+        yield correlations[:, np.searchsorted(union, positions)]
+
+def pearson_permutation_test(data, indices, permutations=1000, absolute=True,
+                             n_jobs=1, seed=None, dtype=None):
+    '''
+    Get Pearson's r like `pearson` along with permutation test p-values.
+
+    The null distribution of each correlation is sampled by correlating with
+    randomly permuted columns (samples) of ``data[indices]``. Rows are
+    standardised only once: permuting the columns of a standardised row gives
+    the standardised permuted row. Blocks of rows are correlated in parallel
+    against all permutations, in batches of one matrix multiply each, and only
+    the number of null correlations at least as extreme as the observed one is
+    kept, never the null correlations themselves.
+
+    Parameters
+    ----------
+    data : ArrayLike[float]
+        2D array for which to calculate correlations between rows.
+    indices
+        Indices to derive the subset ``data[indices]`` to compare against. You
+        may use any form of numpy indexing.
+    permutations : int
+        Number of permutations to sample.
+    absolute : bool
+        If True, a two-sided test comparing ``abs(r)``. If False, a one-sided
+        test for positive correlation.
+    n_jobs : int
+        Number of threads to run blocks of rows on, see `pearson`.
+    seed : int or None
+        Seed of the permutations. Batches of permutations get independent
+        random streams derived from it, which each block of rows replays, so
+        results only depend on ``seed``, not on ``n_jobs``. If None, a fresh
+        seed is used.
+    dtype
+        dtype to compute the correlations in, see `pearson`.
+
+    Returns
+    -------
+    correlation_matrix : ArrayLike[float]
+        Same as ``pearson(data, indices)``.
+    p_values : ArrayLike[float]
+        Empirical p-value of each correlation, ``(1 + k) / (1 + permutations)``
+        where ``k`` is the number of null correlations at least as extreme as
+        the observed one. NaN where the correlation is NaN.
+
+    Notes
+    -----
+    On top of the results, this takes a standardised copy of ``data``, an
+    integer array of the same shape as the results and per job a few
+    ``_TILE_SIZE * _TILE_SIZE`` blocks of null correlations.
+    '''
+    if permutations < 1:
+        raise ValueError(f'permutations must be at least 1, got: {permutations}')
+    n_jobs = _resolve_n_jobs(n_jobs)
+    dtype = _resolve_dtype(data, dtype)
 
-    # `not len` is required instead of just `not`, otherwise you get
-    # 'ValueError: The truth value of a Int64Index is ambiguous'
-    #
     # pylint: disable=len-as-condition
     if not data.size or not len(indices):
-        return np.empty((data.shape[0], len(indices)))
+        shape = (data.shape[0], len(indices))
+        return np.empty(shape, dtype=dtype), np.empty(shape)
 
-    matrix = data
-    mean = matrix[:, 0].copy()
-    delta = np.empty(matrix.shape[0])
-    sum_sq = np.zeros(matrix.shape[0])  # sum of squares
-    sum_cross = np.zeros((matrix.shape[0], len(indices)))
+    standardised = _standardise_rows(data, dtype)
+    baits = standardised[indices]
+    correlations = np.empty((len(data), len(baits)), dtype=dtype)
+    _correlate_rows(standardised, baits, correlations, n_jobs)
+    scores = np.abs(correlations) if absolute else correlations
 
-    for i in range(1, matrix.shape[1]):
-        ratio = i / (i+1)
-        delta = matrix[:, i] - mean
-        sum_sq += (delta**2) * ratio
-        sum_cross += np.outer(delta, delta[indices]) * ratio
-        mean += delta / (i+1)
+    # Batches of permutations stacked into a single matrix of baits of about a
+    # tile wide
+    batch_size = max(1, _TILE_SIZE // len(baits))
+    batch_sizes = [
+        min(batch_size, permutations - start)
+        for start in range(0, permutations, batch_size)
+    ]
+    seeds = np.random.SeedSequence(seed).spawn(len(batch_sizes))
 
-    sum_sq = np.sqrt(sum_sq)
-    with np.errstate(divide='ignore', invalid='ignore'):  # divide by zero, it happens
-        correlations = sum_cross / np.outer(sum_sq, sum_sq[indices])
-    np.clip(correlations, -1, 1, correlations)
-    return correlations
+    # Each block of rows writes its own rows of the counts. Generating the
+    # permutations of a batch again per block is cheap compared to correlating
+    # it.
+    extreme_counts = np.zeros(correlations.shape, dtype=np.int64)
+    def count_extreme(rows):
+        for seed_, size in zip(seeds, batch_sizes):
+            rng = np.random.default_rng(seed_)
+            null_baits = np.concatenate([
+                baits[:, rng.permutation(baits.shape[1])] for _ in range(size)
+            ])
+            null = _correlate_standardised(standardised[rows], null_baits)
+            if absolute:
+                np.abs(null, out=null)
+            null = null.reshape(len(null), size, len(baits))
+            with np.errstate(invalid='ignore'):  # NaN correlations
+                extreme_counts[rows] += (null >= scores[rows, np.newaxis]).sum(axis=1)
+    _map_row_blocks(count_extreme, len(data), n_jobs)
+    p_values = (extreme_counts + 1) / (permutations + 1)
+    p_values[np.isnan(correlations)] = np.nan
+    return correlations, p_values
 
-def pearson_df(data, subset):
+def spearman(data, indices, n_jobs=1, dtype=None):
     '''
-    Get Pearson correlation of each row in a DataFrame compared to a subset
-    thereof.
+    Get Spearman's rho of each row in a 2D array compared to a subset thereof.
+
+    Spearman's rho is Pearson's r of the ranks of the values. Ties get the
+    average of their ranks. Rows are ranked one block at a time, on ``n_jobs``
+    threads, right before they are correlated, so this takes no more memory
+    than `pearson`.
 
     Parameters
     ----------
-    data : ~pandas.DataFrame[float]
-        Data for which to calculate correlations between rows.
-    subset
-        Subset of ``data`` to compare against. ``subset.index`` must be a subset
-        of ``data.index``.
+    data : ArrayLike[float]
+        2D array for which to calculate correlations between rows.
+    indices
+        Indices to derive the subset ``data[indices]`` to compare against. You
+        may use any form of numpy indexing.
+    n_jobs : int
+        Number of threads to use, see `pearson`.
+    dtype
+        dtype of the correlations, see `pearson`.
 
     Returns
     -------
-    correlation_matrix : pandas.DataFrame[float]
-        Data frame with all correlations. ``correlation_matrix.iloc[i,j]``
-        contains the correlation between ``data.iloc[i]`` and
-        ``subset.iloc[j]``. The data frame has ``data.index`` as index and
-        ``subset.index`` as columns.
+    correlation_matrix : ArrayLike[float]
+        2D array of shape ``(len(data), len(indices))`` where
+        ``correlation_matrix[i,j]`` is the correlation of ``data[i]`` and
+        ``data[indices][j]``.
     '''
-    if not data.index.is_unique:
-        raise ValueError('data.index must be unique')
-    correlations = pearson(data.values, subset.index.map(data.index.get_loc))
-    correlations = pd.DataFrame(correlations, index=data.index, columns=subset.index)
+    n_jobs = _resolve_n_jobs(n_jobs)
+    return _correlation_matrix(data, indices, 'spearman', n_jobs, dtype)
+
+def _correlation_matrix(data, indices, method, n_jobs, dtype, missing=None,
+                        min_overlap=2, out=None, max_memory=None):
+    shape = (data.shape[0], len(indices))
+    if out is not None:
+        if dtype is None:
+            dtype = out.dtype
+        if out.shape != shape:
+            raise ValueError(f'out must have shape {shape}, got: {out.shape}')
+    dtype = _resolve_dtype(data, dtype)
+    if out is not None and out.dtype != dtype:
+        raise ValueError(f'out must have dtype {dtype}, got: {out.dtype}')
+
+    # `not len` is required instead of just `not`, otherwise you get
+    # 'ValueError: The truth value of a Int64Index is ambiguous'
+    #
+    # pylint: disable=len-as-condition
+    if not data.size or not len(indices):
+        return np.empty(shape, dtype=dtype) if out is None else out
+
+    # Budget before allocating the result, which counts towards it
+    block_rows = _TILE_SIZE
+    if max_memory is not None:
+        block_rows = min(block_rows, _budget_block_rows(
+            max_memory, data.shape, len(indices), dtype, n_jobs, missing,
+            out is None
+        ))
+    correlations = np.empty(shape, dtype=dtype) if out is None else out
+
+    # Write each block straight into the output
+    correlate_block = _block_correlator(
+        data, indices, method, dtype, missing, min_overlap
+    )
+    def correlate(rows):
+        correlate_block(rows, out=correlations[rows])
+    _map_row_blocks(correlate, data.shape[0], n_jobs, block_rows)
     return correlations
 
-def init_logging(program, version, log_file):
-    root_logger = logging.getLogger()
-    root_logger.setLevel(logging.DEBUG)
+def pearson_blocks(data, indices, block_rows=_TILE_SIZE, n_jobs=1, dtype=None,
+                   missing=None, min_overlap=2, method='pearson'):
+    '''
+    Get Pearson's r like `pearson`, one block of rows at a time.
 
-    formatter = logging.Formatter('{asctime} {levelname[0]}: {message}', style='{')
+    Only a block of rows is standardised and correlated at a time, so peak
+    memory is about ``block_rows * (data.shape[1] + len(indices))`` floats (on
+    top of the standardised ``data[indices]``) instead of the whole correlation
+    matrix. Consume and drop each block to keep it that way.
 
-    # Log to stderr
-    stderr_handler = logging.StreamHandler() # to stderr
-    stderr_handler.setLevel(logging.DEBUG)
-    stderr_handler.setFormatter(formatter)
-    root_logger.addHandler(stderr_handler)
+    Parameters
+    ----------
+    data : ArrayLike[float]
+        2D array for which to calculate correlations between rows.
+    indices
+        Indices to derive the subset ``data[indices]`` to compare against. You
+        may use any form of numpy indexing.
+    block_rows : int
+        Maximum number of rows of ``data`` per block.
+    n_jobs : int
+        Number of threads to correlate blocks on, ``-1`` for 1 per CPU. Up to
+        ``n_jobs`` blocks are computed ahead of the one being consumed, so peak
+        memory grows with it. See `pearson`.
+    dtype
+        dtype of the correlations, see `pearson`.
+    missing, min_overlap
+        How to handle missing values, see `pearson`.
+    method : str
+        ``'pearson'``, or ``'spearman'`` to get correlations like `spearman`
+        instead.
 
-    # and to file
-    file_handler = logging.FileHandler(str(log_file))
-    file_handler.setLevel(logging.DEBUG)
-    file_handler.setFormatter(formatter)
-    root_logger.addHandler(file_handler)
+    Yields
+    ------
+    rows : slice
+        Rows of ``data`` the block contains correlations of, in order.
+    correlations : ArrayLike[float]
+        Same as ``pearson(data, indices)[rows]``.
+    '''
+    if block_rows < 1:
+        raise ValueError(f'block_rows must be at least 1, got: {block_rows}')
+    n_jobs = _resolve_n_jobs(n_jobs)
+    dtype = _resolve_dtype(data, dtype)
+    _validate_missing(missing)
+    _validate_method(method, missing)
 
-    # Log versions
-    logging.info(f'{program} version: {version}')
-    logging.info(f'varbio version: {__version__}')
+    # pylint: disable=len-as-condition
+    if not data.size or not len(indices):
+        for rows in _row_blocks(data.shape[0], block_rows):
+            yield rows, np.full((rows.stop - rows.start, len(indices)), np.nan, dtype)
+        return
+
+    correlate_block = _block_correlator(
+        data, indices, method, dtype, missing, min_overlap
+    )
+    def correlate(rows):
+        return rows, correlate_block(rows)
+    yield from _parallel_map(correlate, _row_blocks(data.shape[0], block_rows), n_jobs)
+
+def _row_blocks(row_count, block_rows):
+    for start in range(0, row_count, block_rows):
+        yield slice(start, min(start + block_rows, row_count))
+
+def _map_row_blocks(function, row_count, n_jobs, max_block_rows=_TILE_SIZE):
+    '''
+    Call function on slices of rows of at most max_block_rows, on n_jobs threads
+
+    Rows are split evenly across the jobs when there are too few for full
+    blocks, so that all jobs get work.
+    '''
+    block_rows = max(1, min(max_block_rows, math.ceil(row_count / n_jobs)))
+    for _ in _parallel_map(function, _row_blocks(row_count, block_rows), n_jobs):
+        pass
+
+def _standardise_rows(data, dtype):
+    'Get `_standardise` of all rows, a block at a time to keep temporaries small'
+    standardised = np.empty(data.shape, dtype=dtype)
+    if data.size:  # without columns there is nothing to standardise
+        for rows in _row_blocks(len(data), _TILE_SIZE):
+            standardised[rows] = _standardise(data[rows], dtype)
+    return standardised
+
+def _correlate_rows(standardised, baits, out, n_jobs):
+    'Get `_correlate_standardised` of all rows into out, on n_jobs threads'
+    def correlate(rows):
+        _correlate_standardised(standardised[rows], baits, out=out[rows])
+    _map_row_blocks(correlate, len(standardised), n_jobs)
+    return out
+
+def _budget_block_rows(max_memory, shape, bait_count, dtype, n_jobs, missing,
+                       count_result):
+    '''
+    Get the most rows per block which keep memory use below max_memory
+
+    If count_result, the ``shape[0] * bait_count`` result counts towards it.
+    '''
+    item_size = np.dtype(dtype).itemsize
+    column_count = shape[1]
+    tile_columns = min(bait_count, _TILE_SIZE)
+
+    if missing == 'pairwise':
+        # The baits' values and masks, see `_pairwise_operand`, and per job the
+        # squares of a tile of them
+        fixed = (
+            bait_count * column_count * (8 + 1 + 8 + 8)
+            + n_jobs * tile_columns * column_count * 8
+        )
+
+        # Per row of a block, likewise, and about 10 float64 sums per tile of
+        # correlations
+        per_row = column_count * (8 + 1 + 1 + 8 + 8) + tile_columns * 10 * 8
+    else:
+        # The baits as float64 while standardising and then standardised
+        fixed = bait_count * column_count * (2 * 8 + item_size)
+
+        # Per row of a block, likewise, and the tile of correlations
+        per_row = column_count * (2 * 8 + item_size) + tile_columns * item_size
+
+    if count_result:
+        fixed += shape[0] * bait_count * item_size
+
+    block_rows = (max_memory - fixed) // (per_row * n_jobs)
+    if block_rows < 1:
+        raise ValueError(
+            f'max_memory must be at least {fixed + per_row * n_jobs} bytes for '
+            f'{bait_count} baits, {column_count} columns and {n_jobs} jobs, '
+            f'got: {max_memory}'
+        )
+    return block_rows
+
+def _resolve_n_jobs(n_jobs):
+    if n_jobs == -1:
+        return os.cpu_count() or 1
+    if n_jobs < 1:
+        raise ValueError(f'n_jobs must be at least 1, or -1, got: {n_jobs}')
+    return n_jobs
+
+def _resolve_dtype(data, dtype):
+    if dtype is None:
+        return np.dtype(np.float32 if data.dtype == np.float32 else np.float64)
+    dtype = np.dtype(dtype)
+    if dtype not in (np.float32, np.float64):
+        raise ValueError(f'dtype must be float32 or float64, got: {dtype}')
+    return dtype
+
+def _validate_missing(missing):
+    if missing not in (None, 'pairwise'):
+        raise ValueError(f'Unknown missing: {missing!r}')
+
+def _validate_method(method, missing):
+    if method not in ('pearson', 'spearman'):
+        raise ValueError(f'Unknown method: {method!r}')
+    if method == 'spearman' and missing is not None:
+        raise ValueError('missing is not supported by spearman')
+
+def _block_correlator(data, indices, method, dtype, missing, min_overlap):
+    '''
+    Prepare ``data[indices]`` once, return a function to correlate blocks
+
+    The function takes a slice of rows of ``data`` and optionally an ``out``
+    array and returns the correlations of those rows.
+    '''
+    if method == 'spearman':
+        baits = _standardise(_rank(data[indices]), dtype)
+        def correlate(rows, out=None):
+            return _pearson_block(_rank(data[rows]), baits, out)
+    elif missing is None:
+        baits = _standardise(data[indices], dtype)
+        def correlate(rows, out=None):
+            return _pearson_block(data[rows], baits, out)
+    else:
+        baits = _pairwise_operand(data[indices])
+        def correlate(rows, out=None):
+            return _pearson_pairwise_block(
+                data[rows], baits, min_overlap, dtype, out
+            )
+    return correlate
+
+def _parallel_map(function, items, n_jobs):
+    '''
+    Like `map`, but call function on ``n_jobs`` threads
+
+    Results are yielded in order. At most ``n_jobs`` calls are pending at a
+    time, so memory stays bounded when results are consumed lazily.
+    '''
+    if n_jobs == 1:
+        yield from map(function, items)
+        return
+    with ThreadPoolExecutor(n_jobs) as executor:
+        pending = deque()
+        for item in items:
+            if len(pending) == n_jobs:
+                yield pending.popleft().result()
+            pending.append(executor.submit(function, item))
+        while pending:
+            yield pending.popleft().result()
+
+def _pearson_block(rows, baits, out=None):
+    '''
+    Get Pearson's r of rows compared to already standardised baits
+
+    Parameters
+    ----------
+    rows : ArrayLike[float]
+        2D array of the rows to correlate.
+    baits : ArrayLike[float]
+        Result of `_standardise` of the rows to compare against.
+    out : ArrayLike[float] or None
+        Array to write the correlations to, of shape ``(len(rows),
+        len(baits))``.
+
+    Returns
+    -------
+    ArrayLike[float]
+        Correlations, clipped to ``[-1, 1]``.
+    '''
+    return _correlate_standardised(_standardise(rows, baits.dtype), baits, out)
+
+def _correlate_standardised(standardised, baits, out=None):
+    'Like _pearson_block, but with rows already standardised as well'
+    if out is None:
+        out = np.empty(
+            (len(standardised), len(baits)),
+            dtype=np.result_type(standardised, baits)
+        )
+    for column in range(0, len(baits), _TILE_SIZE):
+        columns = slice(column, column + _TILE_SIZE)
+        np.matmul(standardised, baits[columns].T, out=out[:, columns])
+    np.clip(out, -1, 1, out)
+    return out
+
+def _standardise(data, dtype=np.float64):
+    '''
+    Centre each row on its mean and scale it to unit length (L2 norm)
+
+    The dot product of 2 standardised rows is their Pearson's r. Rows with zero
+    variance become NaN. Always computed in float64, the result is then cast
+    to ``dtype``.
+    '''
+    # Taking pearson of NaN, inf, -inf values is not supported
+    assert np.isfinite(data).all()
+
+    # Shifting by the first value first, like gsl_stats_correlation does,
+    # reduces cancellation error and keeps constant rows exactly 0 so they
+    # don't get a garbage correlation instead of NaN.
+    standardised = np.array(data, dtype=float)
+    standardised -= standardised[:, [0]]
+    standardised -= standardised.mean(axis=1, keepdims=True)
+    norms = np.sqrt(np.einsum('ij,ij->i', standardised, standardised))
+    with np.errstate(divide='ignore', invalid='ignore'):  # divide by zero, it happens
+        standardised /= norms[:, np.newaxis]
+    return standardised.astype(dtype, copy=False)
+
+def _rank(data):
+    'Rank the values of each row, giving ties the average of their ranks'
+    # Taking spearman of NaN, inf, -inf values is not supported
+    assert np.isfinite(data).all()
+    return scipy.stats.rankdata(data, axis=1)
+
+def _pairwise_operand(data):
+    '''
+    Prepare rows with missing values for `_pearson_pairwise_block`
+
+    Returns
+    -------
+    values : ArrayLike[float]
+        Rows centred on the mean of their values, with 0 where missing.
+    mask : ArrayLike[float]
+        1 where present, 0 where missing.
+    '''
+    # NaN is missing, inf and -inf are still not supported
+    assert not np.isinf(data).any()
+
+    present = ~np.isnan(data)
+    values = np.array(data, dtype=float)
+
+    # Shift by the first value present like `_standardise`, so constant rows
+    # stay exactly 0. Rows without values are all NaN, they end up all 0.
+    values -= values[np.arange(len(values)), present.argmax(axis=1)][:, np.newaxis]
+    values[~present] = 0
+    counts = np.maximum(present.sum(axis=1), 1)
+    values -= (values.sum(axis=1) / counts)[:, np.newaxis]
+    values[~present] = 0
+    return values, present.astype(float)
+
+def _pearson_pairwise_block(rows, baits, min_overlap, dtype, out=None):
+    '''
+    Get pairwise-complete Pearson's r of rows compared to baits
+
+    Parameters
+    ----------
+    rows : ArrayLike[float]
+        2D array of the rows to correlate, NaN where missing.
+    baits
+        Result of `_pairwise_operand` of the rows to compare against.
+    min_overlap : int
+        Pairs with fewer values in common get NaN.
+    dtype
+        dtype of the correlations.
+    out : ArrayLike[float] or None
+        Array to write the correlations to.
+    '''
+    values, mask = _pairwise_operand(rows)
+    bait_values, bait_mask = baits
+    if out is None:
+        out = np.empty((len(values), len(bait_values)), dtype=dtype)
+    for column in range(0, len(bait_values), _TILE_SIZE):
+        columns = slice(column, column + _TILE_SIZE)
+        y = bait_values[columns].T
+        y_mask = bait_mask[columns].T
+
+        # Sums over the columns both rows have a value in
+        count = mask @ y_mask
+        sum_x = values @ y_mask
+        sum_y = mask @ y
+        sum_sq_x = np.square(values) @ y_mask
+        sum_sq_y = mask @ np.square(y)
+        with np.errstate(divide='ignore', invalid='ignore'):  # count of 0
+            covariance = values @ y - sum_x * sum_y / count
+            variance_x = sum_sq_x - sum_x**2 / count
+            variance_y = sum_sq_y - sum_y**2 / count
+            correlations = covariance / np.sqrt(variance_x * variance_y)
+
+        # Rows are centred on all their values, not just those in the overlap,
+        # so a row that is constant on the overlap gets a variance of rounding
+        # error rather than exactly 0. Compare it to the sum of squares it
+        # cancelled out of.
+        tolerance = count * np.finfo(float).eps
+        undefined = (
+            (count < min_overlap)
+            | (variance_x <= tolerance * sum_sq_x)
+            | (variance_y <= tolerance * sum_sq_y)
+        )
+        correlations[undefined] = np.nan
+        np.clip(correlations, -1, 1, correlations)
+        out[:, columns] = correlations
+    return out
+
+def _pearson_streaming(data, indices):
+    # Taking pearson of NaN, inf, -inf values is not supported
+    assert np.isfinite(data).all()
+
+    matrix = data
+    mean = matrix[:, 0].copy()
+    delta = np.empty(matrix.shape[0])
+    sum_sq = np.zeros(matrix.shape[0])  # sum of squares
+    sum_cross = np.zeros((matrix.shape[0], len(indices)))
+
+    for i in range(1, matrix.shape[1]):
+        ratio = i / (i+1)
+        delta = matrix[:, i] - mean
+        sum_sq += (delta**2) * ratio
+        sum_cross += np.outer(delta, delta[indices]) * ratio
+        mean += delta / (i+1)
+
+    sum_sq = np.sqrt(sum_sq)
+    with np.errstate(divide='ignore', invalid='ignore'):  # divide by zero, it happens
+        correlations = sum_cross / np.outer(sum_sq, sum_sq[indices])
+    np.clip(correlations, -1, 1, correlations)
+    return correlations
+
+def pearson_edges(data, indices, threshold=None, top_k=None, absolute=False,
+                  block_rows=_TILE_SIZE, n_jobs=1, dtype=None, missing=None,
+                  min_overlap=2, method='pearson'):
+    '''
+    Get Pearson's r like `pearson`, but only keep the strongest correlations.
+
+    Correlations are filtered one block of rows at a time (see
+    `pearson_blocks`), so memory scales with the number of edges kept rather
+    than with ``len(data) * len(indices)``.
+
+    Parameters
+    ----------
+    data : ArrayLike[float]
+        2D array for which to calculate correlations between rows.
+    indices
+        Indices to derive the subset ``data[indices]`` to compare against. You
+        may use any form of numpy indexing.
+    threshold : float or None
+        If not None, only keep correlations ``>= threshold``.
+    top_k : int or None
+        If not None, only keep the ``top_k`` highest correlations of each
+        column of the correlation matrix, i.e. of each ``data[indices][j]``.
+        Ties are broken arbitrarily.
+    absolute : bool
+        If True, compare ``abs(r)`` instead of ``r`` to ``threshold`` and
+        ``top_k``.
+    block_rows : int
+        Maximum number of rows of ``data`` to correlate at a time.
+    n_jobs : int
+        Number of threads to correlate blocks on, see `pearson_blocks`.
+    dtype
+        dtype to compute the correlations in, see `pearson`.
+    missing, min_overlap
+        How to handle missing values, see `pearson`.
+    method : str
+        Correlation to use, see `pearson_blocks`.
+
+    Returns
+    -------
+    rows : ArrayLike[int]
+        Row ``i`` in ``data`` of each edge.
+    columns : ArrayLike[int]
+        Position ``j`` in ``indices`` of each edge.
+    correlations : ArrayLike[float]
+        Same as ``pearson(data, indices)[rows, columns]``.
+
+    Edges are sorted by row, then by column. NaN correlations are never kept.
+    At least one of ``threshold`` and ``top_k`` must be given; if both are
+    given, the ``top_k`` of the correlations passing ``threshold`` are kept.
+    '''
+    if threshold is None and top_k is None:
+        raise ValueError('Either threshold or top_k must be given')
+    if top_k is not None and top_k < 1:
+        raise ValueError(f'top_k must be at least 1, got: {top_k}')
+
+    blocks = pearson_blocks(
+        data, indices, block_rows, n_jobs, dtype, missing, min_overlap, method
+    )
+    if top_k is None:
+        edges = [
+            _threshold_edges(rows, block, threshold, absolute)
+            for rows, block in blocks
+        ]
+    else:
+        edges = [_top_k_edges(blocks, len(indices), threshold, top_k, absolute)]
+
+    if not edges:
+        return np.empty(0, dtype=int), np.empty(0, dtype=int), np.empty(0)
+    rows, columns, correlations = map(np.concatenate, zip(*edges))
+    order = np.lexsort((columns, rows))
+    return rows[order], columns[order], correlations[order]
+
+def _edge_scores(correlations, threshold, absolute):
+    'Get scores to select edges by; -inf for those which must not be kept'
+    scores = np.abs(correlations) if absolute else correlations.copy()
+    scores[np.isnan(scores)] = -np.inf
+    if threshold is not None:
+        scores[scores < threshold] = -np.inf
+    return scores
+
+def _threshold_edges(rows, correlations, threshold, absolute):
+    scores = _edge_scores(correlations, threshold, absolute)
+    block_rows, columns = np.nonzero(scores > -np.inf)
+    return block_rows + rows.start, columns, correlations[block_rows, columns]
+
+def _top_k_edges(blocks, column_count, threshold, top_k, absolute):
+    # The best top_k candidates of each column so far. Each block is merged
+    # into them, so memory stays O(top_k * column_count) besides the block.
+    best = _init_top_k(top_k, column_count)
+    for rows, block in blocks:
+        _merge_top_k(
+            best, _edge_scores(block, threshold, absolute),
+            np.arange(rows.start, rows.stop), block, slice(None)
+        )
+    return _get_top_k_edges(best)
+
+def _init_top_k(top_k, column_count):
+    'Get the (scores, rows, correlations) of no candidates yet, see _merge_top_k'
+    return (
+        np.full((top_k, column_count), -np.inf),
+        np.full((top_k, column_count), -1),
+        np.full((top_k, column_count), np.nan),
+    )
+
+def _merge_top_k(best, scores, rows, correlations, columns):
+    '''
+    Merge candidate edges into the best top_k of each column so far
+
+    Parameters
+    ----------
+    best : (ArrayLike[float], ArrayLike[int], ArrayLike[float])
+        Scores, rows and correlations of the best candidates, each of shape
+        ``(top_k, column_count)``. Updated in place.
+    scores : ArrayLike[float]
+        2D array of the scores of the candidates, see `_edge_scores`.
+    rows : ArrayLike[int]
+        Row of each candidate, i.e. of each row of ``scores``.
+    correlations : ArrayLike[float]
+        Correlations of the candidates.
+    columns : slice
+        Columns of ``best`` the columns of ``scores`` are candidates for.
+    '''
+    best_scores, best_rows, best_correlations = best
+    top_k = len(best_scores)
+    scores = np.vstack([best_scores[:, columns], scores])
+    rows = np.vstack([
+        best_rows[:, columns],
+        np.broadcast_to(rows[:, np.newaxis], correlations.shape)
+    ])
+    correlations = np.vstack([best_correlations[:, columns], correlations])
+    keep = np.argpartition(-scores, top_k - 1, axis=0)[:top_k]
+    best_scores[:, columns] = np.take_along_axis(scores, keep, axis=0)
+    best_rows[:, columns] = np.take_along_axis(rows, keep, axis=0)
+    best_correlations[:, columns] = np.take_along_axis(correlations, keep, axis=0)
+
+def _get_top_k_edges(best):
+    'Get the rows, columns and correlations of the merged candidates kept'
+    best_scores, best_rows, best_correlations = best
+    kept = best_scores > -np.inf
+    return best_rows[kept], np.nonzero(kept)[1], best_correlations[kept]
+
+def pearson_all(data, block_rows=_TILE_SIZE, n_jobs=1, dtype=None):
+    '''
+    Get Pearson's r of all pairs of rows of a 2D array, as a packed triangle.
+
+    Like ``pearson(data, np.arange(len(data)))``, but as the correlation matrix
+    is symmetric, only its upper triangle is computed and stored, halving both
+    time and memory. Tiles on the diagonal are products of a block with its
+    own transpose, which numpy computes with BLAS' symmetric rank-k update
+    (SYRK) and so only half of them is computed as well.
+
+    Parameters
+    ----------
+    data : ArrayLike[float]
+        2D array for which to calculate correlations between rows.
+    block_rows : int
+        Rows and columns per tile of the correlation matrix.
+    n_jobs : int
+        Number of threads to correlate tiles on, see `pearson`.
+    dtype
+        dtype of the correlations, see `pearson`.
+
+    Returns
+    -------
+    correlations : ArrayLike[float]
+        1D array with the correlation of each pair of rows ``i < j``, in the
+        same order as `scipy.spatial.distance.pdist`: the correlation of rows
+        ``i`` and ``j`` is at ``len(data) * i - i * (i + 1) // 2 + j - i - 1``.
+        Use `scipy.spatial.distance.squareform` with ``checks=False`` to get
+        the square matrix, with zeros on the diagonal.
+    '''
+    row_count = len(data)
+    dtype = _resolve_dtype(data, dtype)
+    packed = np.full(row_count * (row_count - 1) // 2, np.nan, dtype)
+    for rows, columns, correlations in _upper_tiles(data, block_rows, n_jobs, dtype):
+        for i in range(rows.start, rows.stop):
+            start = max(columns.start, i + 1)
+            if start < columns.stop:
+                # Row i's part of the tile is contiguous in packed
+                offset = row_count * i - i * (i + 1) // 2 + start - i - 1
+                packed[offset:offset + columns.stop - start] = (
+                    correlations[i - rows.start, start - columns.start:]
+                )
+    return packed
+
+def pearson_all_edges(data, threshold=None, top_k=None, absolute=False,
+                      block_rows=_TILE_SIZE, n_jobs=1, dtype=None):
+    '''
+    Get Pearson's r of all pairs of rows like `pearson_all`, but only keep the
+    strongest correlations.
+
+    Like `pearson_edges`, computing only the upper triangle of the
+    correlation matrix, one tile at a time.
+
+    Parameters
+    ----------
+    data : ArrayLike[float]
+        2D array for which to calculate correlations between rows.
+    threshold : float or None
+        If not None, only keep correlations ``>= threshold``.
+    top_k : int or None
+        If not None, only keep the ``top_k`` highest correlations of each row
+        with the other rows. An edge is kept if it's among the ``top_k`` of
+        either row. Ties are broken arbitrarily.
+    absolute : bool
+        If True, compare ``abs(r)`` instead of ``r`` to ``threshold`` and
+        ``top_k``.
+    block_rows : int
+        Rows and columns per tile of the correlation matrix.
+    n_jobs : int
+        Number of threads to correlate tiles on, see `pearson`.
+    dtype
+        dtype to compute the correlations in, see `pearson`.
+
+    Returns
+    -------
+    rows : ArrayLike[int]
+        Row ``i`` of each edge.
+    columns : ArrayLike[int]
+        Row ``j > i`` of each edge.
+    correlations : ArrayLike[float]
+        Correlation of rows ``i`` and ``j`` of each edge.
+
+    Each edge appears once. Edges are sorted by ``i``, then by ``j``.
+    '''
+    if threshold is None and top_k is None:
+        raise ValueError('Either threshold or top_k must be given')
+    if top_k is not None and top_k < 1:
+        raise ValueError(f'top_k must be at least 1, got: {top_k}')
+
+    tiles = _upper_tiles(data, block_rows, n_jobs, dtype)
+    if top_k is None:
+        edges = []
+        for rows, columns, correlations in tiles:
+            tile_rows, tile_columns, tile_correlations = _threshold_edges(
+                rows, correlations, threshold, absolute
+            )
+            edges.append((tile_rows, tile_columns + columns.start, tile_correlations))
+    else:
+        # A tile has the candidates of rows for its columns and, transposed,
+        # those of columns for its rows
+        best = _init_top_k(top_k, len(data))
+        for rows, columns, correlations in tiles:
+            scores = _edge_scores(correlations, threshold, absolute)
+            _merge_top_k(
+                best, scores, np.arange(rows.start, rows.stop), correlations,
+                columns
+            )
+            _merge_top_k(
+                best, scores.T, np.arange(columns.start, columns.stop),
+                correlations.T, rows
+            )
+        rows, columns, correlations = _get_top_k_edges(best)
+
+        # Edges still appear once per row which has it in its top_k
+        if rows.size:
+            pairs = np.stack([np.minimum(rows, columns), np.maximum(rows, columns)])
+            pairs, unique = np.unique(pairs, axis=1, return_index=True)
+            edges = [(pairs[0], pairs[1], correlations[unique])]
+        else:
+            edges = []
+
+    if not edges:
+        return np.empty(0, dtype=int), np.empty(0, dtype=int), np.empty(0)
+    rows, columns, correlations = map(np.concatenate, zip(*edges))
+    order = np.lexsort((columns, rows))
+    return rows[order], columns[order], correlations[order]
+
+def _upper_tiles(data, block_rows, n_jobs, dtype):
+    '''
+    Get Pearson's r of all pairs of rows, one tile of the upper triangle at a
+    time
+
+    Yields
+    ------
+    rows : slice
+    columns : slice
+        Rows of ``data`` whose correlations with ``rows`` the tile contains,
+        ``columns.start >= rows.start``.
+    correlations : ArrayLike[float]
+        Pearson's r of each of ``rows`` with each of ``columns``. In tiles on
+        the diagonal, the diagonal and lower triangle are NaN.
+    '''
+    if block_rows < 1:
+        raise ValueError(f'block_rows must be at least 1, got: {block_rows}')
+    n_jobs = _resolve_n_jobs(n_jobs)
+    dtype = _resolve_dtype(data, dtype)
+    if not data.size:
+        return
+
+    standardised = _standardise_rows(data, dtype)
+
+    blocks = list(_row_blocks(len(data), block_rows))
+    tiles = (
+        (rows, columns)
+        for i, rows in enumerate(blocks)
+        for columns in blocks[i:]
+    )
+    def correlate(tile):
+        rows, columns = tile
+        block = standardised[rows]
+        if rows == columns:
+            # numpy recognises a product with its own transpose as a SYRK
+            correlations = block @ block.T
+            correlations[np.tril_indices(len(block))] = np.nan
+        else:
+            correlations = block @ standardised[columns].T
+        np.clip(correlations, -1, 1, correlations)
+        return rows, columns, correlations
+    yield from _parallel_map(correlate, tiles, n_jobs)
+
+def pearson_df(data, subset, n_jobs=1, dtype=None, missing=None, min_overlap=2,
+               out=None, max_memory=None):
+    '''
+    Get Pearson correlation of each row in a DataFrame compared to a subset
+    thereof.
+
+    Parameters
+    ----------
+    data : ~pandas.DataFrame[float]
+        Data for which to calculate correlations between rows.
+    subset
+        Subset of ``data`` to compare against. ``subset.index`` must be a subset
+        of ``data.index``.
+    n_jobs : int
+        Number of threads to use, see `pearson`.
+    dtype
+        dtype of the correlations, see `pearson`.
+    missing, min_overlap
+        How to handle missing values, see `pearson`.
+    out, max_memory
+        Where to write correlations to and how much memory to use, see
+        `pearson`. ``out`` backs the returned data frame, it is not copied.
+
+    Returns
+    -------
+    correlation_matrix : pandas.DataFrame[float]
+        Data frame with all correlations. ``correlation_matrix.iloc[i,j]``
+        contains the correlation between ``data.iloc[i]`` and
+        ``subset.iloc[j]``. The data frame has ``data.index`` as index and
+        ``subset.index`` as columns.
+    '''
+    if not data.index.is_unique:
+        raise ValueError('data.index must be unique')
+    correlations = pearson(
+        data.values, _get_positions(data.index, subset.index, 'data'), n_jobs=n_jobs,
+        dtype=dtype, missing=missing, min_overlap=min_overlap, out=out,
+        max_memory=max_memory
+    )
+    correlations = pd.DataFrame(
+        correlations, index=data.index, columns=subset.index, copy=False
+    )
+    return correlations
+
+def pearson_df_batch(data, bait_sets, n_jobs=1, dtype=None, missing=None,
+                     min_overlap=2):
+    '''
+    Get Pearson correlation like `pearson_df`, for each of many bait sets at
+    once.
+
+    See `pearson_batch`.
+
+    Parameters
+    ----------
+    data : ~pandas.DataFrame[float]
+        Data for which to calculate correlations between rows.
+    bait_sets : ~typing.Iterable[~typing.Iterable[str]]
+        Names of the rows in ``data`` of each bait set.
+    n_jobs, dtype, missing, min_overlap
+        See `pearson`.
+
+    Yields
+    ------
+    correlation_matrix : pandas.DataFrame[float]
+        Data frame with ``data.index`` as index and the bait set as columns,
+        for each bait set in order.
+
+    Raises
+    ------
+    KeyError
+        If a bait is not in ``data.index``.
+    '''
+    if not data.index.is_unique:
+        raise ValueError('data.index must be unique')
+    bait_sets = [pd.Index(baits) for baits in bait_sets]
+    index_sets = [_get_positions(data.index, baits, 'data') for baits in bait_sets]
+    batch = pearson_batch(
+        data.values, index_sets, n_jobs=n_jobs, dtype=dtype, missing=missing,
+        min_overlap=min_overlap
+    )
+    for baits, correlations in zip(bait_sets, batch):
+        yield pd.DataFrame(correlations, index=data.index, columns=baits)
+
+def pearson_df_permutation_test(data, subset, permutations=1000, absolute=True,
+                                n_jobs=1, seed=None, dtype=None):
+    '''
+    Get Pearson correlation like `pearson_df` along with permutation test
+    p-values.
+
+    See `pearson_permutation_test`.
+
+    Returns
+    -------
+    correlation_matrix : pandas.DataFrame[float]
+        Same as `pearson_df`.
+    p_values : pandas.DataFrame[float]
+        p-value of each correlation, with the same index and columns.
+    '''
+    if not data.index.is_unique:
+        raise ValueError('data.index must be unique')
+    correlations, p_values = pearson_permutation_test(
+        data.values, _get_positions(data.index, subset.index, 'data'),
+        permutations=permutations, absolute=absolute, n_jobs=n_jobs, seed=seed,
+        dtype=dtype
+    )
+    return (
+        pd.DataFrame(correlations, index=data.index, columns=subset.index),
+        pd.DataFrame(p_values, index=data.index, columns=subset.index),
+    )
+
+def _get_positions(index, labels, name):
+    '''
+    Get the positions of labels in a unique index
+
+    A single vectorised lookup in the hash table pandas caches on the index.
+
+    Raises
+    ------
+    KeyError
+        Listing all labels not in the index, of the matrix called name.
+    '''
+    positions = index.get_indexer(labels)
+    missing = pd.Index(labels)[positions == -1]
+    if not missing.empty:
+        raise KeyError(f'Baits not in {name}: {", ".join(map(repr, missing))}')
+    return positions
+
+def spearman_df(data, subset, n_jobs=1, dtype=None):
+    '''
+    Get Spearman correlation of each row in a DataFrame compared to a subset
+    thereof.
+
+    Like `pearson_df`, but with `spearman` instead of `pearson`.
+    '''
+    if not data.index.is_unique:
+        raise ValueError('data.index must be unique')
+    correlations = spearman(
+        data.values, _get_positions(data.index, subset.index, 'data'), n_jobs=n_jobs,
+        dtype=dtype
+    )
+    return pd.DataFrame(correlations, index=data.index, columns=subset.index)
+
+def pearson_df_edges(data, subset, threshold=None, top_k=None, absolute=False,
+                     n_jobs=1, dtype=None, missing=None, min_overlap=2,
+                     method='pearson'):
+    '''
+    Get Pearson correlation like `pearson_df`, but only keep the strongest
+    correlations.
+
+    Parameters
+    ----------
+    data : ~pandas.DataFrame[float]
+        Data for which to calculate correlations between rows.
+    subset
+        Subset of ``data`` to compare against. ``subset.index`` must be a subset
+        of ``data.index``.
+    threshold, top_k, absolute
+        Which correlations to keep, see `pearson_edges`.
+    n_jobs : int
+        Number of threads to use, see `pearson_blocks`.
+    dtype
+        dtype to compute the correlations in, see `pearson`.
+    missing, min_overlap
+        How to handle missing values, see `pearson`.
+    method : str
+        Correlation to use, see `pearson_blocks`.
+
+    Returns
+    -------
+    edges : pandas.DataFrame
+        Data frame with a row per correlation kept and columns: ``gene``, the
+        ``data.index`` value; ``bait``, the ``subset.index`` value; and ``r``,
+        their correlation.
+    '''
+    if not data.index.is_unique:
+        raise ValueError('data.index must be unique')
+    rows, columns, correlations = pearson_edges(
+        data.values, _get_positions(data.index, subset.index, 'data'),
+        threshold=threshold, top_k=top_k, absolute=absolute, n_jobs=n_jobs,
+        dtype=dtype, missing=missing, min_overlap=min_overlap, method=method
+    )
+    return pd.DataFrame({
+        'gene': data.index[rows],
+        'bait': subset.index[columns],
+        'r': correlations,
+    })
+
+@attr.s(slots=True, repr=False, frozen=True)
+class StandardisedMatrix:
+
+    '''
+    Expression matrix prepared for repeated correlation queries.
+
+    Get one with `ExpressionMatrix.prepare_correlation`. Its rows are centred
+    and scaled to unit length once, so each query is just a slice and a matrix
+    multiply instead of a `pearson_df` call which standardises all rows again.
+
+    Parameters
+    ----------
+    name : str
+        Name of the matrix it was derived from.
+    index : ~pandas.Index
+        Row (gene) names.
+    values : ArrayLike[float]
+        Read-only 2D array with the standardised rows, see `_standardise`.
+    '''
+
+    name = attr.ib()
+    'str'
+
+    index = attr.ib()
+    'pandas.Index'
+
+    values = attr.ib()
+    'ArrayLike[float], standardised rows'
+
+    def __repr__(self):
+        return f'StandardisedMatrix({self.name!r})'
+
+    @classmethod
+    def from_df(cls, name, data, dtype=None):
+        '''
+        Standardise the rows of a data frame
+
+        Rows are standardised in float64 regardless of ``dtype``, one block at a
+        time to keep temporaries small. ``dtype`` defaults to that of ``data``,
+        see `pearson`.
+        '''
+        values = _standardise_rows(data.values, _resolve_dtype(data.values, dtype))
+        values.flags.writeable = False
+        return cls(name=name, index=data.index, values=values)
+
+    def pearson(self, indices, n_jobs=1):
+        '''
+        Get Pearson's r of each row compared to a subset thereof.
+
+        Same as ``pearson(matrix.data.values, indices)``, but faster.
+
+        Parameters
+        ----------
+        indices
+            Indices of the rows to compare against, see `pearson`.
+        n_jobs : int
+            Number of threads to use, see `pearson`.
+
+        Returns
+        -------
+        correlation_matrix : ArrayLike[float]
+            Of shape ``(len(index), len(indices))``, in the dtype of `values`.
+        '''
+        n_jobs = _resolve_n_jobs(n_jobs)
+        baits = self.values[indices]
+        row_count = len(self.values)
+        correlations = np.empty((row_count, len(baits)), dtype=self.values.dtype)
+        if not self.values.shape[1]:
+            # Undefined, like in `pearson_blocks`, rather than 0 from an empty
+            # matrix multiply
+            correlations.fill(np.nan)
+            return correlations
+        return _correlate_rows(self.values, baits, correlations, n_jobs)
+
+    def pearson_df(self, baits, n_jobs=1):
+        '''
+        Get Pearson's r of each row compared to the rows of the baits.
+
+        Parameters
+        ----------
+        baits : ~typing.Iterable[str]
+            Names of the rows to compare against.
+        n_jobs : int
+            Number of threads to use, see `pearson`.
+
+        Returns
+        -------
+        correlation_matrix : pandas.DataFrame[float]
+            Data frame with `index` as index and ``baits`` as columns.
+
+        Raises
+        ------
+        KeyError
+            If a bait is not in `index`.
+        '''
+        baits = pd.Index(baits)
+        indices = _get_positions(self.index, baits, self.name)
+        return pd.DataFrame(
+            self.pearson(indices, n_jobs=n_jobs), index=self.index,
+            columns=baits
+        )
+
+def meta_pearson(matrices, baits, threshold=None, absolute=False,
+                 block_rows=_TILE_SIZE, n_jobs=1, dtype=None):
+    '''
+    Get Pearson's r of genes compared to baits, aggregated across matrices.
+
+    Genes are aligned across matrices by their row name. Each matrix is
+    correlated one block of rows at a time (see `pearson_blocks`) and each
+    block is folded into running sums right away, so memory stays at that of
+    the aggregates, however many matrices there are.
+
+    Parameters
+    ----------
+    matrices : ~typing.Iterable[ExpressionMatrix]
+    baits : ~typing.Iterable[str]
+        Names of the rows to compare against. A matrix without some of the
+        baits only contributes to those it has.
+    threshold : float or None
+        If not None, also count the matrices in which a correlation is
+        ``>= threshold``.
+    absolute : bool
+        If True, compare ``abs(r)`` to ``threshold`` instead.
+    block_rows, n_jobs, dtype
+        See `pearson_blocks`.
+
+    Returns
+    -------
+    MetaCorrelation
+        With genes in order of first appearance across the matrices as
+        index and ``baits`` as columns.
+
+    Raises
+    ------
+    UserError
+        Listing all baits which are in none of the matrices.
+    '''
+    matrices = list(matrices)
+    baits = pd.Index(baits)
+    genes = pd.Index([], dtype=object)
+    for matrix in matrices:
+        index = matrix.data.index
+        genes = genes.append(index[~index.isin(genes)])
+    if matrices:
+        genes.name = matrices[0].data.index.name
+
+    missing = baits[~baits.isin(genes)]
+    if not missing.empty:
+        raise UserError(
+            f'Baits not in any of the matrices: {", ".join(map(repr, missing))}'
+        )
+
+    shape = (len(genes), len(baits))
+    sum_r = np.zeros(shape)
+    sum_z = np.zeros(shape)  # weighted by sample count - 3
+    sum_weights = np.zeros(shape)
+    count = np.zeros(shape, dtype=int)
+    count_above = None if threshold is None else np.zeros(shape, dtype=int)
+    for matrix in matrices:
+        values = matrix.data.values
+        bait_positions = matrix.data.index.get_indexer(baits)
+        columns = np.flatnonzero(bait_positions != -1)
+        if not columns.size:
+            continue
+        gene_positions = genes.get_indexer(matrix.data.index)
+
+        # Fisher's z of r has a variance of 1 / (sample count - 3)
+        weight = max(values.shape[1] - 3, 0)
+
+        blocks = pearson_blocks(
+            values, bait_positions[columns], block_rows, n_jobs, dtype
+        )
+        for rows, block in blocks:
+            tile = np.ix_(gene_positions[rows], columns)
+            defined = ~np.isnan(block)
+            r = np.where(defined, block, 0)
+            sum_r[tile] += r
+            sum_z[tile] += weight * np.arctanh(np.clip(r, -_MAX_R, _MAX_R))
+            sum_weights[tile] += weight * defined
+            count[tile] += defined
+            if threshold is not None:
+                with np.errstate(invalid='ignore'):  # NaN correlations
+                    scores = np.abs(block) if absolute else block
+                    count_above[tile] += scores >= threshold
+
+    with np.errstate(divide='ignore', invalid='ignore'):  # those not in any matrix
+        mean = sum_r / count
+        combined = np.tanh(sum_z / sum_weights)
+    def to_df(values):
+        return pd.DataFrame(values, index=genes, columns=baits, copy=False)
+    return MetaCorrelation(
+        mean=to_df(mean),
+        combined=to_df(combined),
+        count=to_df(count),
+        count_above=None if count_above is None else to_df(count_above),
+    )
+
+# Largest float below 1, Fisher's z of r = ±1 is infinite
+_MAX_R = np.nextafter(1, 0)
+
+@attr.s(slots=True, frozen=True)
+class MetaCorrelation:
+
+    '''
+    Correlations of genes with baits aggregated across matrices, see
+    `meta_pearson`.
+
+    Each attribute is a data frame with genes as index and baits as columns.
+    Correlations of a gene or bait missing from a matrix, or which are NaN in
+    it, do not count towards the aggregates; an aggregate of no correlations
+    is NaN. `combined` is the inverse z-transform of the mean of the Fisher
+    z-transforms of the correlations, weighted by the sample count - 3 of
+    their matrix; matrices with 3 samples or less get no weight.
+    '''
+
+    mean = attr.ib()
+    'pandas.DataFrame[float], mean r'
+
+    combined = attr.ib()
+    "pandas.DataFrame[float], r combined with Fisher's z-transform"
+
+    count = attr.ib()
+    'pandas.DataFrame[int], number of matrices with a correlation'
+
+    count_above = attr.ib()
+    'pandas.DataFrame[int] or None, number of matrices passing the threshold'
+
+@attr.s(slots=True, repr=False)
+class PearsonAccumulator:
+
+    '''
+    Pearson's r of rows compared to a subset thereof, updatable with new columns.
+
+    Keeps the sufficient statistics of `pearson`'s streaming algorithm: the
+    number of columns, the mean and the sum of squared deviations of each row
+    and the sum of cross deviations of each row with each of the subset. When
+    columns (samples) are added with `update`, their statistics are merged in
+    (Chan et al.'s parallel form of Welford's update), so correlations can be
+    kept up to date without revisiting earlier columns.
+
+    Get one with `from_data`, or `load` one saved with `save`.
+
+    Parameters
+    ----------
+    indices : ArrayLike[int]
+        Positions of the rows of the subset.
+    count : int
+        Number of columns seen so far.
+    shift : ArrayLike[float]
+        First value of each row. Values are shifted by it before accumulating
+        so constant rows have exactly 0 deviation, like in `_standardise`.
+    mean : ArrayLike[float]
+        Mean of each row, minus its shift.
+    sum_sq : ArrayLike[float]
+        Sum of squared deviations from the mean of each row.
+    sum_cross : ArrayLike[float]
+        ``sum_cross[i,j]`` is the sum of the products of the deviations of row
+        ``i`` and row ``indices[j]``.
+    '''
+
+    _format_version = 1
+
+    indices = attr.ib()
+    count = attr.ib()
+    shift = attr.ib()
+    mean = attr.ib()
+    sum_sq = attr.ib()
+    sum_cross = attr.ib()
+
+    def __repr__(self):
+        return (
+            f'PearsonAccumulator({len(self.mean)} rows, {len(self.indices)} '
+            f'baits, {self.count} columns)'
+        )
+
+    @classmethod
+    def from_data(cls, data, indices):
+        '''
+        Start accumulating from a 2D array
+
+        Parameters
+        ----------
+        data : ArrayLike[float]
+            2D array of the columns seen so far. Rows can't be added later, only
+            columns.
+        indices
+            Indices of the rows to compare against, see `pearson`.
+
+        Returns
+        -------
+        PearsonAccumulator
+        '''
+        row_count = data.shape[0]
+        indices = np.atleast_1d(np.arange(row_count)[indices])
+        accumulator = cls(
+            indices=indices,
+            count=0,
+            shift=np.zeros(row_count),
+            mean=np.zeros(row_count),
+            sum_sq=np.zeros(row_count),
+            sum_cross=np.zeros((row_count, len(indices))),
+        )
+        accumulator.update(data)
+        return accumulator
+
+    def update(self, new_columns):
+        '''
+        Add columns
+
+        Parameters
+        ----------
+        new_columns : ArrayLike[float]
+            2D array with the values of the new columns of each row, in the same
+            row order as the original data.
+        '''
+        if new_columns.shape[0] != len(self.mean):
+            raise ValueError(
+                f'new_columns must have {len(self.mean)} rows, got: '
+                f'{new_columns.shape[0]}'
+            )
+        if not new_columns.shape[1]:
+            return
+
+        # Taking pearson of NaN, inf, -inf values is not supported
+        assert np.isfinite(new_columns).all()
+
+        if not self.count:
+            self.shift = np.array(new_columns[:, 0], dtype=float)
+        new_columns = new_columns - self.shift[:, np.newaxis]
+
+        # Statistics of the new columns on their own
+        new_count = new_columns.shape[1]
+        new_mean = new_columns.mean(axis=1)
+        centred = new_columns - new_mean[:, np.newaxis]
+        new_sum_sq = np.einsum('ij,ij->i', centred, centred)
+        new_sum_cross = centred @ centred[self.indices].T
+
+        # Merge them into ours
+        count = self.count + new_count
+        delta = new_mean - self.mean
+        weight = self.count * new_count / count
+        self.mean += delta * (new_count / count)
+        self.sum_sq += new_sum_sq + delta**2 * weight
+        self.sum_cross += new_sum_cross + np.outer(delta, delta[self.indices] * weight)
+        self.count = count
+
+    def result(self):
+        '''
+        Get the correlations of all columns seen so far
+
+        Returns
+        -------
+        correlation_matrix : ArrayLike[float]
+            Same as ``pearson(data, indices)`` of the original data with all
+            new columns appended.
+        '''
+        norms = np.sqrt(self.sum_sq)
+        with np.errstate(divide='ignore', invalid='ignore'):  # divide by zero, it happens
+            correlations = self.sum_cross / np.outer(norms, norms[self.indices])
+        np.clip(correlations, -1, 1, correlations)
+        return correlations
+
+    def save(self, path):
+        '''
+        Save to a directory
+
+        Parameters
+        ----------
+        path : ~pathlib.Path
+            Directory to save to. If it exists, it is replaced as a whole, so
+            an interrupted save leaves the previous save intact.
+        '''
+        meta = {
+            'format_version': self._format_version,
+            'varbio_version': __version__,
+            'count': self.count,
+        }
+        with replace_directory(path) as temporary:
+            for name in ('indices', 'shift', 'mean', 'sum_sq', 'sum_cross'):
+                np.save(temporary / f'{name}.npy', getattr(self, name))
+            (temporary / 'meta.json').write_text(json.dumps(meta))
+
+    @classmethod
+    def load(cls, path):
+        '''
+        Load an accumulator saved with `save`
+
+        Parameters
+        ----------
+        path : ~pathlib.Path
+
+        Returns
+        -------
+        PearsonAccumulator
+        '''
+        meta = json.loads((path / 'meta.json').read_text())
+        if meta['format_version'] != cls._format_version:
+            raise ValueError(
+                f'{path} has format version {meta["format_version"]}, varbio '
+                f'{__version__} only supports version {cls._format_version}'
+            )
+        arrays = {
+            name: np.load(path / f'{name}.npy')
+            for name in ('indices', 'shift', 'mean', 'sum_sq', 'sum_cross')
+        }
+        return cls(count=meta['count'], **arrays)
+
+def init_logging(program, version, log_file, spans_file=None):
+    '''
+    Log to stderr and to a file
+
+    Parameters
+    ----------
+    program : str
+        Name of the program, logged along with its version.
+    version : str
+    log_file : ~pathlib.Path
+    spans_file : ~pathlib.Path or None
+        If not None, enable spans (see `span`): log them and also write them to
+        this file as JSON lines, one JSON object of the fields of a span per
+        line, for monitoring to scrape.
+    '''
+    root_logger = logging.getLogger()
+    root_logger.setLevel(logging.DEBUG)
+
+    formatter = logging.Formatter('{asctime} {levelname[0]}: {message}', style='{')
+
+    # Log to stderr
+    stderr_handler = logging.StreamHandler() # to stderr
+    stderr_handler.setLevel(logging.DEBUG)
+    stderr_handler.setFormatter(formatter)
+    root_logger.addHandler(stderr_handler)
+
+    # and to file
+    file_handler = logging.FileHandler(str(log_file))
+    file_handler.setLevel(logging.DEBUG)
+    file_handler.setFormatter(formatter)
+    root_logger.addHandler(file_handler)
+
+    # Spans are opt-in
+    span_logger = logging.getLogger('varbio.spans')
+    if spans_file is None:
+        span_logger.setLevel(logging.INFO)
+    else:
+        span_logger.setLevel(logging.DEBUG)
+        spans_handler = logging.FileHandler(str(spans_file))
+        spans_handler.setFormatter(_JsonLinesFormatter())
+        span_logger.addHandler(spans_handler)
+
+    # Log versions
+    logging.info(f'{program} version: {version}')
+    logging.info(f'varbio version: {__version__}')
+
+class _JsonLinesFormatter(logging.Formatter):
+
+    'Format span records as a JSON object of their fields, with the time'
+
+    def format(self, record):
+        return json.dumps(dict(record.span, time=record.created), default=str)